@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
 #include <gio/gio.h>
 
@@ -76,61 +77,154 @@ typedef struct _transfer_handler {
     GVariant *result;
 }TransferHandler;
 
+struct _CamelMapTransfer {
+	GDBusProxy *transfer;
+	TransferHandler handler;
+	gulong signal_id;
+	char *transfer_obj;
+	char *file_name;
+	/* Set when obexd had dropped the transfer before its status was
+	 * seen, only the file can tell how it went */
+	gboolean unknown;
+	/* The signal handler holds a reference of its own, it may still
+	 * be running on the main context after finish disconnected it */
+	gint ref_count;
+};
+
+static void
+transfer_unref (CamelMapTransfer *transfer)
+{
+	if (!g_atomic_int_dec_and_test (&transfer->ref_count))
+		return;
+
+	g_mutex_clear (&transfer->handler.lock);
+	g_cond_clear (&transfer->handler.cond);
+	g_free (transfer->transfer_obj);
+	g_free (transfer->file_name);
+	g_free (transfer);
+}
+
+/* Expects the handler lock to be held */
+static void
+transfer_update_status (TransferHandler *handler,
+			const char *status)
+{
+	if (g_ascii_strcasecmp (status, "error") == 0) {
+		handler->complete = TRUE;
+		handler->error = TRUE;
+		printf("Launching cond signal handler after error\n");
+		g_cond_signal (&handler->cond);
+	} else if (g_ascii_strcasecmp (status, "complete") == 0) {
+		handler->complete = TRUE;
+		handler->error = FALSE;
+		printf("Launching cond signal handler after complete\n");
+		g_cond_signal (&handler->cond);
+	}
+}
+
 static void 
 transfer_on_signal (GDBusProxy *proxy,
 		    GVariant   *changed_properties,
 		    GStrv       invalidated_properties,
 		    gpointer    user_data)
 {
-    TransferHandler *handler = (TransferHandler *)user_data;
+    TransferHandler *handler = &((CamelMapTransfer *) user_data)->handler;
     GVariantIter iter;
     GVariant *value;
     gchar *key;
-    guint i;
-
 
     printf("%s\n", g_variant_print (changed_properties, TRUE));
+    g_mutex_lock (&handler->lock);
     g_variant_iter_init (&iter, changed_properties);
-    
     while (g_variant_iter_next (&iter, "{sv}", &key, &value)) {
-		if (g_ascii_strcasecmp (key, "Status") == 0) {
-			const char *status = g_variant_get_string (value, NULL);
-
-			if (g_ascii_strcasecmp (status, "error") == 0) {
-				handler->complete = TRUE;
-				handler->error = TRUE;
-				printf("Launching cond signal handler after error\n");
-				g_cond_signal (&handler->cond);
-			} else if (g_ascii_strcasecmp (status, "complete") == 0) {
-				handler->complete = TRUE;
-				handler->error = FALSE;
-				printf("Launching cond signal handler after complete\n");
-				g_cond_signal (&handler->cond);
-			}
-		}
+		if (g_ascii_strcasecmp (key, "Status") == 0)
+			transfer_update_status (handler, g_variant_get_string (value, NULL));
 	    g_free (key);
 	    g_variant_unref (value);
     }
+    g_mutex_unlock (&handler->lock);
+}
+
+/* Wraps the (oa{sv}) reply of Message1.Get. If more is given, it is
+ * set from the FractionDeliver property of the reply. */
+static CamelMapTransfer *
+transfer_new_from_reply (GDBusProxy *object,
+			 GVariant *ret,
+			 const char *file_name,
+			 gboolean *more,
+			 GCancellable *cancellable)
+{
+	GVariant *prop, *status, *deliver;
+	const char *transfer_obj;
+	CamelMapTransfer *transfer;
+
+	printf("*************** %s\n", g_variant_print(ret, TRUE));
+
+	/* Get the transfer object (oa{sv}) */
+	g_variant_get (ret, "(&o@a{sv})", &transfer_obj, &prop);
+	printf("TRA: %s\n", transfer_obj);
 
+	if (more) {
+		deliver = g_variant_lookup_value (prop, "FractionDeliver", G_VARIANT_TYPE_STRING);
+		*more = deliver && g_ascii_strcasecmp (g_variant_get_string (deliver, NULL), "more") == 0;
+		if (deliver)
+			g_variant_unref (deliver);
+	}
+
+	transfer = g_new0 (CamelMapTransfer, 1);
+	transfer->ref_count = 1;
+	g_cond_init (&transfer->handler.cond);
+	g_mutex_init (&transfer->handler.lock);
+	transfer->transfer_obj = g_strdup (transfer_obj);
+	transfer->file_name = g_strdup (file_name);
+	g_variant_unref (prop);
+
+	transfer->transfer = g_dbus_proxy_new_sync (g_dbus_proxy_get_connection(object),
+					G_DBUS_PROXY_FLAGS_NONE,
+					NULL,
+					"org.bluez.obex",
+					transfer->transfer_obj,
+					"org.bluez.obex.Transfer1",
+					cancellable,
+					NULL);
+	if (!transfer->transfer) {
+		/* Already gone, the file tells whether it made it */
+		transfer->handler.complete = TRUE;
+		transfer->unknown = TRUE;
+		return transfer;
+	}
+
+	g_mutex_lock (&transfer->handler.lock);
+	g_atomic_int_inc (&transfer->ref_count);
+	transfer->signal_id = g_signal_connect_data (
+		transfer->transfer, "g-properties-changed",
+		G_CALLBACK (transfer_on_signal), transfer,
+		(GClosureNotify) transfer_unref, 0);
+
+	/* A short transfer may have finished before we started listening */
+	status = g_dbus_proxy_get_cached_property (transfer->transfer, "Status");
+	if (status) {
+		transfer_update_status (&transfer->handler, g_variant_get_string (status, NULL));
+		g_variant_unref (status);
+	} else {
+		transfer->handler.complete = TRUE;
+		transfer->unknown = TRUE;
+	}
+	g_mutex_unlock (&transfer->handler.lock);
+
+	return transfer;
 }
 
-gboolean
-camel_map_dbus_get_message (GDBusProxy *object,
-			    const char *message_object_id,
-			    const char *file_name,
-			    GCancellable *cancellable,
-			    GError **error)
+static GVariant *
+message_call_get (GDBusProxy *object,
+		  const char *message_object_id,
+		  GVariant *args,
+		  GCancellable *cancellable,
+		  GError **error)
 {
-	GVariant *ret, *v;
-	GVariantBuilder *b;
-	GDBusProxy *message, *transfer;
-	TransferHandler *handler;
-	gint64 end_time;
-	gboolean success = FALSE;
-	GVariant *prop, *item;
-	GVariantIter top_iter;
-	char *transfer_obj;
-	
+	GDBusProxy *message;
+	GVariant *ret;
+
 	message = g_dbus_proxy_new_sync (g_dbus_proxy_get_connection(object),
 					G_DBUS_PROXY_FLAGS_NONE,
 					NULL,
@@ -139,75 +233,193 @@ camel_map_dbus_get_message (GDBusProxy *object,
 					"org.bluez.obex.Message1",
 					cancellable,
 					error);
+	if (!message) {
+		g_variant_unref (g_variant_ref_sink (args));
+	    	return NULL;
+	}
 
-	if (!message)
-	    return FALSE;
-
-	b = g_variant_builder_new (G_VARIANT_TYPE ("(sb)"));
-	g_variant_builder_add (b, "s", file_name);
-	g_variant_builder_add (b, "b", TRUE);
-	v = g_variant_builder_end (b);
-	
 	ret = g_dbus_proxy_call_sync (message,
 			"Get",
-			v,
+			args,
 			G_DBUS_CALL_FLAGS_NONE,
 			-1,
 			cancellable,
 			error);
-	
-	
-	printf("*************** %s\n", ret ? g_variant_print(ret, TRUE) :((*error)->message));
 	g_object_unref (message);
 
-	/* Get the transfer object (oa{sv}) */
-	
-	g_variant_iter_init (&top_iter, ret);
-	//item = g_variant_iter_next_value (&top_iter);
-	g_variant_get (ret, "(&o@a{sv})", &transfer_obj, &prop);
-	printf("TRA: %s\n", transfer_obj);
-	//g_object_unref (prop);
-
-	/* Co-ordinate with Transfer handler and return synchronously */
-	handler = g_new0 (TransferHandler, 1);
-	g_cond_init (&handler->cond);
-	g_mutex_init (&handler->lock);
-	handler->complete = FALSE;
-	handler->result = NULL;
-	
+	return ret;
+}
+
+/* Issues Message1.Get and returns without waiting for the transfer,
+ * so that several Gets can be queued on the session back to back.
+ * obexd runs them in order; each must be completed with
+ * camel_map_dbus_finish_transfer(). Without attachment the device
+ * leaves out the attachments, which is all that is needed to read. */
+CamelMapTransfer *
+camel_map_dbus_start_get_message (GDBusProxy *object,
+				  const char *message_object_id,
+				  const char *file_name,
+				  gboolean attachment,
+				  GCancellable *cancellable,
+				  GError **error)
+{
+	GVariant *ret;
+	CamelMapTransfer *transfer;
+
+	ret = message_call_get (object,
+				message_object_id,
+				g_variant_new ("(sb)", file_name, attachment),
+				cancellable,
+				error);
+	if (!ret)
+		return NULL;
+
+	transfer = transfer_new_from_reply (object, ret, file_name, NULL, cancellable);
+	g_variant_unref (ret);
+
+	return transfer;
+}
+
+/* Like camel_map_dbus_start_get_message(), but asks for a single
+ * fraction of the message (FractionRequest first or next), which lets
+ * large emails be shown before they are complete. more tells whether
+ * the device has further fractions. Daemons that don't take the
+ * options argument fail with G_IO_ERROR_NOT_SUPPORTED. */
+CamelMapTransfer *
+camel_map_dbus_start_get_message_fraction (GDBusProxy *object,
+					   const char *message_object_id,
+					   const char *file_name,
+					   gboolean next,
+					   gboolean *more,
+					   GCancellable *cancellable,
+					   GError **error)
+{
+	GVariant *ret;
+	GVariantBuilder *b;
+	GError *local_error = NULL;
+	CamelMapTransfer *transfer;
+
+	b = g_variant_builder_new (G_VARIANT_TYPE ("(sba{sv})"));
+	g_variant_builder_add (b, "s", file_name);
+	g_variant_builder_add (b, "b", TRUE);
+	g_variant_builder_open (b, G_VARIANT_TYPE ("a{sv}"));
+	g_variant_builder_add (b, "{sv}", "FractionRequest", g_variant_new_string (next ? "next" : "first"));
+	g_variant_builder_close (b);
+
+	ret = message_call_get (object,
+				message_object_id,
+				g_variant_builder_end (b),
+				cancellable,
+				&local_error);
+	g_variant_builder_unref (b);
+
+	if (!ret) {
+		if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS) ||
+		    g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+				     "Fractional Get not supported: %s", local_error->message);
+			g_error_free (local_error);
+		} else
+			g_propagate_error (error, local_error);
+
+		return NULL;
+	}
+
+	transfer = transfer_new_from_reply (object, ret, file_name, more, cancellable);
+	g_variant_unref (ret);
+
+	return transfer;
+}
+
+/* A bMessage that made it to the disk ends with END:BMSG, a truncated
+ * or empty one does not */
+static gboolean
+transfer_file_is_complete (const char *file_name)
+{
+	char tail[64];
+	size_t len;
+	FILE *f;
+
+	f = fopen (file_name, "rb");
+	if (!f)
+		return FALSE;
+
+	if (fseek (f, -(long) (sizeof (tail) - 1), SEEK_END) != 0)
+		rewind (f);
+	len = fread (tail, 1, sizeof (tail) - 1, f);
+	fclose (f);
+	tail[len] = '\0';
+
+	return len > 0 && strstr (tail, "END:BMSG") != NULL;
+}
+
+/* Waits for a transfer started with camel_map_dbus_start_get_message()
+ * and frees it. */
+gboolean
+camel_map_dbus_finish_transfer (CamelMapTransfer *transfer,
+				GError **error)
+{
+	TransferHandler *handler = &transfer->handler;
+	gint64 end_time;
+	gboolean success;
+
 	g_mutex_lock (&handler->lock);
+
 	/* We would kinda wait 2 mins */
 	end_time = g_get_monotonic_time () + 120 * G_TIME_SPAN_SECOND;
-	transfer = g_dbus_proxy_new_sync (g_dbus_proxy_get_connection(object),
-					G_DBUS_PROXY_FLAGS_NONE,
-					NULL,
-					"org.bluez.obex",
-					transfer_obj,
-					"org.bluez.obex.Transfer1",
-					cancellable,
-					error);
-
-	g_signal_connect (transfer, "g-properties-changed", G_CALLBACK (transfer_on_signal), handler);
-
 	while (!handler->complete) {
 	    printf("going to wait\n");
 	    if (!g_cond_wait_until (&handler->cond, &handler->lock, end_time)) {
 		// timeout has passed.
-		g_mutex_unlock (&handler->lock);
 		break;
 	    }
 	}
 	printf("Awake\n");
-	g_mutex_clear (&handler->lock);
-	g_cond_clear (&handler->cond);
-	success = handler->error != TRUE;
-	g_free (handler);
-	
-	printf("&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&& %s\n", transfer_obj);
-	return success;
 
+	success = handler->complete && !handler->error;
+	if (success && transfer->unknown)
+		success = transfer_file_is_complete (transfer->file_name);
+	if (!success)
+		g_set_error (error, G_IO_ERROR,
+			     handler->complete ? G_IO_ERROR_FAILED : G_IO_ERROR_TIMED_OUT,
+			     "Transfer %s %s", transfer->transfer_obj,
+			     handler->complete ? "failed" : "timed out");
+	g_mutex_unlock (&handler->lock);
+
+	/* A callback already dispatched keeps the transfer alive until
+	 * it returns, the handler's reference goes with its closure */
+	if (transfer->transfer) {
+		g_signal_handler_disconnect (transfer->transfer, transfer->signal_id);
+		g_object_unref (transfer->transfer);
+	}
+
+	printf("&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&& %s\n", transfer->transfer_obj);
+	transfer_unref (transfer);
+
+	return success;
 }
 
+gboolean
+camel_map_dbus_get_message (GDBusProxy *object,
+			    const char *message_object_id,
+			    const char *file_name,
+			    gboolean attachment,
+			    GCancellable *cancellable,
+			    GError **error)
+{
+	CamelMapTransfer *transfer;
+
+	transfer = camel_map_dbus_start_get_message (object,
+						     message_object_id,
+						     file_name,
+						     attachment,
+						     cancellable,
+						     error);
+	if (!transfer)
+		return FALSE;
+
+	return camel_map_dbus_finish_transfer (transfer, error);
+}
 
 gboolean
 camel_map_dbus_set_message_read (GDBusProxy *object,
@@ -278,6 +490,96 @@ camel_map_dbus_set_message_deleted (GDBusProxy *object,
 }
 
 
+/* How many Properties.Set calls are kept in flight by a batch */
+#define SET_PIPELINE_DEPTH 16
+
+typedef struct _SetPropertyCall {
+	GError *error;
+	guint *in_flight;
+} SetPropertyCall;
+
+static void
+set_property_done_cb (GObject *source,
+		      GAsyncResult *result,
+		      gpointer user_data)
+{
+	SetPropertyCall *call = user_data;
+	GVariant *ret;
+
+	ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &call->error);
+	if (ret)
+		g_variant_unref (ret);
+	(*call->in_flight)--;
+}
+
+static void
+set_property_clear_error (gpointer data)
+{
+	if (data)
+		g_error_free (data);
+}
+
+/* Sets a boolean Message1 property (Read or Deleted) on every message
+ * in msg_ids, keeping several calls in flight instead of waiting for
+ * each reply. Returns an array as long as msg_ids with the GError of
+ * each message that failed and NULL for each one that succeeded; free
+ * it with g_ptr_array_unref(). */
+GPtrArray *
+camel_map_dbus_set_messages_property (GDBusProxy *object,
+				      GPtrArray *msg_ids,
+				      const char *property,
+				      gboolean value,
+				      GCancellable *cancellable)
+{
+	GDBusConnection *connection;
+	GMainContext *context;
+	SetPropertyCall *calls;
+	GPtrArray *errors;
+	guint in_flight = 0;
+	guint i;
+
+	connection = g_dbus_proxy_get_connection (object);
+	calls = g_new0 (SetPropertyCall, msg_ids->len);
+
+	/* Replies are dispatched from our own context, so this works
+	 * from any thread */
+	context = g_main_context_new ();
+	g_main_context_push_thread_default (context);
+
+	for (i = 0; i < msg_ids->len; i++) {
+		while (in_flight >= SET_PIPELINE_DEPTH)
+			g_main_context_iteration (context, TRUE);
+
+		calls[i].in_flight = &in_flight;
+		in_flight++;
+		g_dbus_connection_call (connection,
+					"org.bluez.obex",
+					msg_ids->pdata[i],
+					"org.freedesktop.DBus.Properties",
+					"Set",
+					g_variant_new ("(ssv)", "org.bluez.obex.Message1", property, g_variant_new_boolean (value)),
+					NULL,
+					G_DBUS_CALL_FLAGS_NONE,
+					-1,
+					cancellable,
+					set_property_done_cb,
+					&calls[i]);
+	}
+
+	while (in_flight > 0)
+		g_main_context_iteration (context, TRUE);
+
+	g_main_context_pop_thread_default (context);
+	g_main_context_unref (context);
+
+	errors = g_ptr_array_new_with_free_func (set_property_clear_error);
+	for (i = 0; i < msg_ids->len; i++)
+		g_ptr_array_add (errors, calls[i].error);
+	g_free (calls);
+
+	return errors;
+}
+
 GVariant *
 camel_map_dbus_set_current_folder (GDBusProxy *object,
 				   const char *folder,
@@ -5,6 +5,8 @@
 #include <gio/gio.h>
 #include <glib.h>
 
+typedef struct _CamelMapTransfer CamelMapTransfer;
+
 GDBusConnection *	camel_map_connect_dbus 			(GCancellable *cancellable,
                   						 GError **error);
 char *			camel_map_connect_device_channel 	(GDBusConnection *connection, 
@@ -26,8 +28,25 @@ GVariant *		camel_map_dbus_get_message_listing 	(GDBusProxy *object,
 gboolean		camel_map_dbus_get_message 		(GDBusProxy *object,
 								 const char *message_object_id,
 								 const char *file_name,
+								 gboolean attachment,
+								 GCancellable *cancellable,
+								 GError **error);
+CamelMapTransfer *	camel_map_dbus_start_get_message 	(GDBusProxy *object,
+								 const char *message_object_id,
+								 const char *file_name,
+								 gboolean attachment,
 								 GCancellable *cancellable,
 								 GError **error);
+CamelMapTransfer *	camel_map_dbus_start_get_message_fraction
+								(GDBusProxy *object,
+								 const char *message_object_id,
+								 const char *file_name,
+								 gboolean next,
+								 gboolean *more,
+								 GCancellable *cancellable,
+								 GError **error);
+gboolean		camel_map_dbus_finish_transfer 		(CamelMapTransfer *transfer,
+								 GError **error);
 
 gboolean		camel_map_dbus_set_message_read 	(GDBusProxy *object,
 								 const char *msg_id,
@@ -39,6 +58,11 @@ gboolean		camel_map_dbus_set_message_deleted 	(GDBusProxy *object,
 								 gboolean read,
 								 GCancellable *cancellable,
 								 GError **error);
+GPtrArray *		camel_map_dbus_set_messages_property	(GDBusProxy *object,
+								 GPtrArray *msg_ids,
+								 const char *property,
+								 gboolean value,
+								 GCancellable *cancellable);
 
 gboolean		camel_map_dbus_update_inbox 		(GDBusProxy *proxy,
                              					 GCancellable *cancellable,
@@ -33,6 +33,8 @@ which needs to be better organized via functions */
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -48,13 +50,13 @@ which needs to be better organized via functions */
 #include "camel-map-store.h"
 #include "camel-map-summary.h"
 #include "camel-map-dbus-utils.h"
+#include "camel-map-sms.h"
 
 #define CAMEL_MAP_FOLDER_GET_PRIVATE(obj) \
 	(G_TYPE_INSTANCE_GET_PRIVATE \
 	((obj), CAMEL_TYPE_MAP_FOLDER, CamelMapFolderPrivate))
 
 struct _CamelMapFolderPrivate {
-	GDBusProxy *map;
 	char *map_dir;
 	GMutex *search_lock;	/* for locking the search object */
 	GStaticRecMutex cache_lock;	/* for locking the cache object */
@@ -65,84 +67,235 @@ struct _CamelMapFolderPrivate {
 	GMutex *state_lock;
 	GCond *fetch_cond;
 	GHashTable *uid_eflags;
+
+	/* Converts downloaded bMessages while the next ones transfer */
+	GThreadPool *parse_pool;
+
+	/* Read/Deleted changes not written to the device yet, also
+	 * kept in a journal so that they survive being offline */
+	GMutex *flags_lock;
+	GHashTable *pending_flags;	/* uid -> MapFlagIntent */
+	gboolean flags_flush_queued;
+	gchar *journal_file;
+	FILE *journal;
+	gboolean journal_unsynced;	/* appended to since the last fsync */
+
+	/* Summary changes are saved in the background once they settle */
+	GMutex *save_lock;
+	guint save_source;
+	gint64 save_deadline;	/* monotonic time; 0 while nothing is dirty */
 };
 
+typedef struct _MapFlagIntent {
+	guint32 mask;	/* CAMEL_MESSAGE_SEEN and/or CAMEL_MESSAGE_DELETED */
+	guint32 value;
+	gint64 time;	/* of the last change, seconds; 0 if not known */
+} MapFlagIntent;
+
 extern gint camel_application_is_exiting;
 
 static gboolean map_refresh_info_sync (CamelFolder *folder, GCancellable *cancellable, GError **error);
+static gboolean map_folder_flush_flags_cb (CamelMapStore *map_store, gpointer user_data, GCancellable *cancellable, GError **error);
+static void map_folder_journal_load (CamelMapFolder *map_folder, const gchar *folder_dir);
+static guint32 map_folder_get_pending_flags (CamelMapFolder *map_folder, const gchar *uid, guint32 *value, gint64 *time);
+static void map_folder_forget_flags (CamelMapFolder *map_folder, GList *uids);
+static void map_folder_schedule_flags_flush (CamelMapFolder *map_folder);
+static void map_folder_schedule_summary_save (CamelMapFolder *map_folder);
 
 #define d(x)
 
+/* How many Gets a batch fetch keeps queued on the session at once */
+#define MAP_FETCH_PIPELINE_DEPTH 8
+
+/* How many messages downsync hands to a single batch fetch */
+#define MAP_DOWNSYNC_BATCH_SIZE 50
+
+/* How many downloaded messages are converted at once */
+#define MAP_PARSE_THREADS 2
+
+/* A dirty summary is saved once it has been left alone this long (in
+ * seconds), but never later than MAP_SUMMARY_SAVE_MAX_LATENCY after it
+ * first became dirty, even if changes keep coming in */
+#define MAP_SUMMARY_SAVE_DELAY 2
+#define MAP_SUMMARY_SAVE_MAX_LATENCY 15
+
+/* Messages are cached either in full, under "cur", or as a preview
+ * fetched without attachments, under "part". Opening a message only
+ * needs the preview; anything smaller than this is fetched in full
+ * right away since leaving out the attachments would save next to
+ * nothing. */
+#define MAP_CACHE_FULL "cur"
+#define MAP_CACHE_PARTIAL "part"
+#define MAP_CACHE_TMP "tmp"
+#define MAP_PREVIEW_MIN_SIZE (64 * 1024)
+
 G_DEFINE_TYPE (CamelMapFolder, camel_map_folder, CAMEL_TYPE_OFFLINE_FOLDER)
 
+/* Folders don't keep the session proxy around, it only exists while the
+ * store is connected and is replaced on every reconnect. */
+static GDBusProxy *
+map_folder_ref_proxy (CamelMapFolder *map_folder,
+		      GError **error)
+{
+	CamelMapStore *map_store;
+	GDBusProxy *map;
+
+	map_store = (CamelMapStore *) camel_folder_get_parent_store ((CamelFolder *) map_folder);
+	map = camel_map_store_ref_map_proxy (map_store);
+	if (!map)
+		g_set_error_literal (
+			error, CAMEL_SERVICE_ERROR, CAMEL_SERVICE_ERROR_UNAVAILABLE,
+			_("You must be working online to complete this operation"));
+
+	return map;
+}
+
+/* Cache entries are keyed by the uid itself: MAP handles are plain
+ * hex numbers that are safe to use as file names, and CamelDataCache
+ * already spreads them over its buckets. */
 static gchar *
 map_get_filename (CamelFolder *folder,
                   const gchar *uid,
                   GError **error)
 {
 	CamelMapFolder *map_folder = CAMEL_MAP_FOLDER (folder);
-	GChecksum *sha = g_checksum_new (G_CHECKSUM_SHA256);
-	gchar *filename;
-
-	g_checksum_update (sha, (guchar *) uid, strlen (uid));
-	filename = camel_data_cache_get_filename (
-		map_folder->cache, "cur", g_checksum_get_string (sha));
-	g_checksum_free (sha);
 
-	return filename;
+	return camel_data_cache_get_filename (map_folder->cache, MAP_CACHE_FULL, uid);
 }
 
-static gint
-map_data_cache_remove (CamelDataCache *cdc,
-                       const gchar *path,
-                       const gchar *key,
-                       GError **error)
+/* Earlier versions keyed the cache by the SHA-256 of the uid, which had
+ * to be recomputed on every lookup. Rename those entries once, in a
+ * session job so that opening the folder doesn't wait for it; the
+ * marker file records that the folder has been converted and is only
+ * written once every entry made it. Until then a lookup may miss an
+ * entry not renamed yet, which at worst fetches it again. */
+static void
+map_folder_migrate_cache_keys_job (CamelSession *session,
+				   GCancellable *cancellable,
+				   CamelMapFolder *map_folder,
+				   GError **error)
 {
-	GChecksum *sha = g_checksum_new (G_CHECKSUM_SHA256);
-	gint ret;
+	CamelFolder *folder = (CamelFolder *) map_folder;
+	const gchar *paths[] = { MAP_CACHE_FULL, MAP_CACHE_PARTIAL };
+	GPtrArray *uids;
+	gchar *marker;
+	gboolean success = TRUE;
+	gint i, j;
 
-	g_checksum_update (sha, (guchar *) key, strlen (key));
-	ret = camel_data_cache_remove (
-		cdc, path, g_checksum_get_string (sha), error);
-	g_checksum_free (sha);
+	marker = g_build_filename (camel_data_cache_get_path (map_folder->cache), "cache-keys", NULL);
+	if (g_file_test (marker, G_FILE_TEST_EXISTS)) {
+		g_free (marker);
+		return;
+	}
 
-	return ret;
-}
+	uids = camel_folder_summary_get_array (folder->summary);
+	for (i = 0; uids && i < uids->len; i++) {
+		const gchar *uid = uids->pdata[i];
+		gchar *sha;
 
-static CamelStream *
-map_data_cache_get (CamelDataCache *cdc,
-                    const gchar *path,
-                    const gchar *key,
-                    GError **error)
-{
-	GChecksum *sha = g_checksum_new (G_CHECKSUM_SHA256);
-	CamelStream *ret;
+		if (g_cancellable_is_cancelled (cancellable)) {
+			success = FALSE;
+			break;
+		}
+
+		sha = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uid, -1);
+		g_static_rec_mutex_lock (&map_folder->priv->cache_lock);
+		for (j = 0; j < G_N_ELEMENTS (paths); j++) {
+			gchar *old_fname, *new_fname, *dir;
+
+			old_fname = camel_data_cache_get_filename (map_folder->cache, paths[j], sha);
+			if (g_access (old_fname, F_OK) == 0) {
+				new_fname = camel_data_cache_get_filename (map_folder->cache, paths[j], uid);
+				dir = g_path_get_dirname (new_fname);
+
+				if (g_access (new_fname, F_OK) == 0) {
+					/* Fetched again meanwhile, the old entry is stale */
+					g_unlink (old_fname);
+				} else if (g_mkdir_with_parents (dir, 0700) == -1 ||
+					   g_rename (old_fname, new_fname) == -1) {
+					g_warning ("Could not move cache entry %s: %s",
+						   old_fname, g_strerror (errno));
+					success = FALSE;
+				}
 
-	g_checksum_update (sha, (guchar *) key, strlen (key));
-	ret = camel_data_cache_get (
-		cdc, path, g_checksum_get_string (sha), error);
-	g_checksum_free (sha);
+				g_free (dir);
+				g_free (new_fname);
+			}
+			g_free (old_fname);
+		}
+		g_static_rec_mutex_unlock (&map_folder->priv->cache_lock);
+		g_free (sha);
+	}
+	if (uids)
+		camel_folder_summary_free_array (uids);
 
-	return ret;
+	/* Left for the next open to retry */
+	if (success)
+		g_file_set_contents (marker, "1\n", -1, NULL);
+	g_free (marker);
 }
 
+/* Each transfer and each cache entry being written gets its own file in
+ * the cache's tmp area, so concurrent fetches don't trample on each
+ * other. Being on the same file system as the entries, they can be
+ * renamed into place. */
 static gchar *
-map_data_cache_get_filename (CamelDataCache *cdc,
-                             const gchar *path,
-                             const gchar *key,
-                             GError **error)
+map_folder_new_temp_file (CamelMapFolder *map_folder,
+			  const gchar *prefix,
+			  GError **error)
 {
-	GChecksum *sha = g_checksum_new (G_CHECKSUM_SHA256);
-	gchar *filename;
+	gchar *dir, *filename;
+	gint fd;
+
+	dir = g_build_filename (camel_data_cache_get_path (map_folder->cache), MAP_CACHE_TMP, NULL);
+	if (g_mkdir_with_parents (dir, 0700) == -1) {
+		g_set_error (
+			error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Unable to create cache path"));
+		g_free (dir);
+		return NULL;
+	}
 
-	g_checksum_update (sha, (guchar *) key, strlen (key));
-	filename = camel_data_cache_get_filename (
-		cdc, path, g_checksum_get_string (sha));
-	g_checksum_free (sha);
+	filename = g_strdup_printf ("%s/%s-XXXXXX", dir, prefix);
+	g_free (dir);
+
+	fd = g_mkstemp (filename);
+	if (fd == -1) {
+		g_set_error (
+			error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			"%s: %s", filename, g_strerror (errno));
+		g_free (filename);
+		return NULL;
+	}
+	close (fd);
 
 	return filename;
 }
 
+/* Removes whatever an interrupted session left in the tmp area */
+static void
+map_folder_clear_temp_files (CamelMapFolder *map_folder)
+{
+	const gchar *name;
+	gchar *path;
+	GDir *dir;
+
+	path = g_build_filename (camel_data_cache_get_path (map_folder->cache), MAP_CACHE_TMP, NULL);
+	dir = g_dir_open (path, 0, NULL);
+	if (dir) {
+		while ((name = g_dir_read_name (dir))) {
+			gchar *filename = g_build_filename (path, name, NULL);
+			g_unlink (filename);
+			g_free (filename);
+		}
+		g_dir_close (dir);
+	}
+	g_free (path);
+}
+
+/* Expunges the messages flagged for deletion. The Deleted sets are
+ * pipelined, and whatever the device accepted leaves the summary in
+ * one go; the rest stays flagged for the next expunge. */
 static gboolean
 map_folder_delete_messages (CamelFolder *folder,
 			    GCancellable *cancellable,
@@ -150,81 +303,118 @@ map_folder_delete_messages (CamelFolder *folder,
 {
 	CamelMapFolder *map_folder;
 	CamelMapStore *map_store;
-	int i;
-	GPtrArray *known_uids;
-	CamelMessageInfo *info;
+	guint i, failed = 0;
+	GPtrArray *deleted_uids, *msg_ids, *results;
+	GList *removed = NULL, *link;
 	CamelFolderChangeInfo *changes;
+	GDBusProxy *map;
+	GError *local_error = NULL;
 	
 	map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
 	map_folder = (CamelMapFolder *) folder;
 
-	camel_folder_summary_prepare_fetch_all (folder->summary, NULL);
-	known_uids = camel_folder_summary_get_array (folder->summary);
-	if (!known_uids)
+	deleted_uids = camel_folder_search_by_expression (
+		folder, "(match-all (system-flag \"Deleted\"))", cancellable, &local_error);
+	if (!deleted_uids) {
+		if (local_error) {
+			g_propagate_error (error, local_error);
+			return FALSE;
+		}
 		return TRUE;
+	}
+	if (!deleted_uids->len) {
+		camel_folder_search_free (folder, deleted_uids);
+		return TRUE;
+	}
+
+	map = map_folder_ref_proxy (map_folder, error);
+	if (!map) {
+		camel_folder_search_free (folder, deleted_uids);
+		return FALSE;
+	}
+
+	msg_ids = g_ptr_array_new_with_free_func (g_free);
+	for (i = 0; i < deleted_uids->len; i++)
+		g_ptr_array_add (msg_ids, g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), (gchar *) deleted_uids->pdata[i]));
+
+	camel_map_store_folder_lock (map_store, CAMEL_MAP_OPERATION_FLAGS, map_folder->priv->map_dir);
+	if (camel_map_store_set_current_folder (map_store, map_folder->priv->map_dir, cancellable, error))
+		results = camel_map_dbus_set_messages_property (map, msg_ids, "Deleted", TRUE, cancellable);
+	else
+		results = NULL;
+	camel_map_store_folder_unlock (map_store);
+
+	g_ptr_array_unref (msg_ids);
+	g_object_unref (map);
+
+	if (!results) {
+		camel_folder_search_free (folder, deleted_uids);
+		return FALSE;
+	}
 
 	changes = camel_folder_change_info_new ();
-	
-	camel_map_store_folder_lock (map_store);
-	
-	/* Collect UIDs of deleted messages. */
-	for (i = 0; i < known_uids->len; i++) {
-		const gchar *uid = g_ptr_array_index (known_uids, i);
-		
-		info = camel_folder_summary_get (folder->summary, uid);
-		if ((((CamelMessageInfoBase *)info)->flags & CAMEL_MESSAGE_DELETED) != 0) {
-			gboolean success;
-			char *msg_id;
-			
-			msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
+	for (i = 0; i < deleted_uids->len; i++) {
+		const gchar *uid = deleted_uids->pdata[i];
+		GError *set_error = results->pdata[i];
+
+		if (set_error) {
+			printf("Could not delete %s: %s\n", uid, set_error->message);
+			if (!local_error)
+				local_error = g_error_copy (set_error);
+			failed++;
+			continue;
+		}
 
-			success = camel_map_dbus_set_message_deleted (map_folder->priv->map,
-								      msg_id,
-								      TRUE,
-								      cancellable,
-								      error);
+		removed = g_list_prepend (removed, (gpointer) camel_pstring_strdup (uid));
+		camel_folder_change_info_remove_uid (changes, uid);
+	}
+	g_ptr_array_unref (results);
 
-			if (!success || (error && *error)) {
-				/* Return safely */
-				camel_map_store_folder_unlock (map_store);
-				camel_message_info_free (info);
-				camel_folder_summary_free_array (known_uids);
-				if (camel_folder_change_info_changed (changes)) {
-					camel_folder_summary_touch (folder->summary);
-					camel_folder_changed (folder, changes);
-				}
-				camel_folder_change_info_free (changes);
-				
-				return FALSE;
-			}
-			camel_folder_summary_lock (folder->summary, CAMEL_FOLDER_SUMMARY_SUMMARY_LOCK);
-			camel_folder_change_info_remove_uid (changes, uid);
-			camel_folder_summary_remove_uid (folder->summary, uid);
-			map_data_cache_remove (map_folder->cache, "cur", uid, NULL);
-			camel_folder_summary_unlock (folder->summary, CAMEL_FOLDER_SUMMARY_SUMMARY_LOCK);
-			
-								      
+	if (removed) {
+		camel_folder_summary_lock (folder->summary, CAMEL_FOLDER_SUMMARY_SUMMARY_LOCK);
+		camel_folder_summary_remove_uids (folder->summary, removed);
+		camel_folder_summary_unlock (folder->summary, CAMEL_FOLDER_SUMMARY_SUMMARY_LOCK);
+
+		g_static_rec_mutex_lock (&map_folder->priv->cache_lock);
+		for (link = removed; link; link = link->next) {
+			camel_data_cache_remove (map_folder->cache, MAP_CACHE_FULL, link->data, NULL);
+			camel_data_cache_remove (map_folder->cache, MAP_CACHE_PARTIAL, link->data, NULL);
 		}
-		
-		camel_message_info_free (info);
+		g_static_rec_mutex_unlock (&map_folder->priv->cache_lock);
+
+		map_folder_forget_flags (map_folder, removed);
+
+		g_list_free_full (removed, (GDestroyNotify) camel_pstring_free);
 	}
-	
-	camel_map_store_folder_unlock (map_store);
+
 	if (camel_folder_change_info_changed (changes)) {
 		camel_folder_summary_touch (folder->summary);
+		map_folder_schedule_summary_save (map_folder);
 		camel_folder_changed (folder, changes);
 	}
 	camel_folder_change_info_free (changes);
-	
-	
+
+	if (local_error) {
+		g_set_error (
+			error, local_error->domain, local_error->code,
+			_("Could not delete %u of %u messages: %s"),
+			failed, deleted_uids->len, local_error->message);
+		camel_folder_search_free (folder, deleted_uids);
+		g_error_free (local_error);
+		return FALSE;
+	}
+
+	camel_folder_search_free (folder, deleted_uids);
+
 	return TRUE;
 }
 
 static CamelMimeMessage *
-camel_map_folder_get_message_from_cache (CamelMapFolder *map_folder,
-                                         const gchar *uid,
-                                         GCancellable *cancellable,
-                                         GError **error)
+map_folder_get_message_from_cache_path (CamelMapFolder *map_folder,
+					const gchar *path,
+					const gchar *uid,
+					GCancellable *cancellable,
+					GError **error)
 {
 	CamelStream *stream;
 	CamelMimeMessage *msg;
@@ -233,23 +423,10 @@ camel_map_folder_get_message_from_cache (CamelMapFolder *map_folder,
 	priv = map_folder->priv;
 
 	g_static_rec_mutex_lock (&priv->cache_lock);
-	stream = map_data_cache_get (map_folder->cache, "cur", uid, error);
+	stream = camel_data_cache_get (map_folder->cache, path, uid, error);
 	if (!stream) {
-		gchar *old_fname = camel_data_cache_get_filename (
-			map_folder->cache, "cur", uid);
-		if (!g_access (old_fname, R_OK)) {
-			gchar *new_fname = map_data_cache_get_filename (
-				map_folder->cache,
-				"cur", uid, error);
-			g_rename (old_fname, new_fname);
-			g_free (new_fname);
-			stream = map_data_cache_get (map_folder->cache, "cur", uid, error);
-		}
-		g_free (old_fname);
-		if (!stream) {
-			g_static_rec_mutex_unlock (&priv->cache_lock);
-			return NULL;
-		}
+		g_static_rec_mutex_unlock (&priv->cache_lock);
+		return NULL;
 	}
 
 	msg = camel_mime_message_new ();
@@ -260,225 +437,1071 @@ camel_map_folder_get_message_from_cache (CamelMapFolder *map_folder,
 		msg = NULL;
 	}
 
-	g_static_rec_mutex_unlock (&priv->cache_lock);
-	g_object_unref (stream);
+	g_static_rec_mutex_unlock (&priv->cache_lock);
+	g_object_unref (stream);
+
+	return msg;
+}
+
+/* Returns the full message when cached, the preview otherwise */
+static CamelMimeMessage *
+camel_map_folder_get_message_from_cache (CamelMapFolder *map_folder,
+                                         const gchar *uid,
+                                         GCancellable *cancellable,
+                                         GError **error)
+{
+	CamelMimeMessage *msg;
+
+	msg = map_folder_get_message_from_cache_path (map_folder, MAP_CACHE_FULL, uid, cancellable, NULL);
+	if (!msg)
+		msg = map_folder_get_message_from_cache_path (map_folder, MAP_CACHE_PARTIAL, uid, cancellable, error);
+
+	return msg;
+}
+
+static gboolean
+map_folder_has_cached_variant (CamelMapFolder *map_folder,
+			       const gchar *path,
+			       const gchar *uid)
+{
+	gchar *cache_file;
+	gboolean cached;
+
+	cache_file = camel_data_cache_get_filename (map_folder->cache, path, uid);
+	cached = g_access (cache_file, R_OK) == 0;
+	g_free (cache_file);
+
+	return cached;
+}
+
+/* bMessage parsing. The transfer file is read in fixed-size chunks
+ * and fed through a small state machine:
+ *
+ *   BEGIN:BMSG             envelope properties (TYPE, ...)
+ *     BEGIN:VCARD/END:VCARD  originator, ignored
+ *     BEGIN:BENV             recipient vCards, ignored
+ *       BEGIN:BBODY          body properties (CHARSET, LENGTH)
+ *         BEGIN:MSG          content, one or more parts
+ *         END:MSG
+ *       END:BBODY
+ *
+ * LENGTH counts the bytes from the first BEGIN:MSG through the last
+ * END:MSG line. An END:MSG line where that count ends is the end of the
+ * content; anywhere else it only is if BEGIN:MSG or END:BBODY follows,
+ * so one inside the content is kept. A LENGTH that doesn't fit the
+ * file, or that the content overruns, is ignored.
+ *
+ * Content is streamed straight into the cache entry as it arrives, so
+ * memory use does not grow with the message. SMS content is plain text;
+ * the headers that make it a message are written in front of it first. */
+#define MAP_BMSG_CHUNK_SIZE 8192
+
+typedef enum {
+	MAP_BMSG_STATE_ENVELOPE,
+	MAP_BMSG_STATE_BODY,
+	MAP_BMSG_STATE_MSG,
+	MAP_BMSG_STATE_DONE
+} MapBMsgState;
+
+typedef struct _MapBMsgParser {
+	MapBMsgState state;
+	guint8 listed_type;	/* CamelMapMessageType from the listing */
+	gchar *type;		/* bMessage TYPE, for when the listing had none */
+	gchar *charset;
+	guint64 length;
+	guint n_parts;
+
+	guint64 size;		/* of the transfer file */
+	guint64 offset;		/* bytes fed so far */
+	guint64 msg_end;	/* offset LENGTH puts the end at, 0 if not trusted */
+	gchar *held;		/* END:MSG line waiting for the next one to tell */
+	gsize held_len;
+
+	GByteArray *line;	/* line being assembled across chunks */
+	gboolean passthrough;	/* inside a content line too long to be END:MSG */
+
+	CamelFolder *folder;
+	const gchar *uid;
+	CamelStream *sink;	/* the cache entry */
+	CamelStream *sms_stream;	/* SMS content goes through here */
+	GError *error;
+} MapBMsgParser;
+
+static gboolean
+map_bmsg_is_sms (MapBMsgParser *parser)
+{
+	switch (parser->listed_type) {
+	case CAMEL_MAP_MESSAGE_TYPE_SMS_GSM:
+	case CAMEL_MAP_MESSAGE_TYPE_SMS_CDMA:
+		return TRUE;
+	case CAMEL_MAP_MESSAGE_TYPE_UNKNOWN:
+		return parser->type && g_ascii_strncasecmp (parser->type, "SMS", 3) == 0;
+	default:
+		return FALSE;
+	}
+}
+
+/* Writes the headers of the message the SMS becomes, then sets up
+ * sms_stream for the text */
+static gboolean
+map_sms_begin (MapBMsgParser *parser)
+{
+	CamelMessageInfoBase *info;
+	time_t date;
+	gchar *message_id;
+
+	info = (CamelMessageInfoBase *) camel_folder_summary_get (parser->folder->summary, parser->uid);
+	date = info ? info->date_sent : time (NULL);
+	message_id = g_strdup_printf (
+		"camel-%s-%ld-%s-%d",
+		camel_folder_get_display_name (parser->folder),
+		(glong) date, parser->uid, g_random_int ());
+
+	parser->sms_stream = camel_map_sms_begin (
+		parser->sink, info ? info->from : NULL,
+		info ? info->subject : NULL, date, message_id,
+		parser->charset, &parser->error);
+
+	g_free (message_id);
+	if (info)
+		camel_message_info_free (info);
+
+	return parser->sms_stream != NULL;
+}
+
+static void
+map_bmsg_emit (MapBMsgParser *parser,
+	       const gchar *data,
+	       gsize len)
+{
+	CamelStream *stream = parser->sink;
+
+	if (parser->error || !len)
+		return;
+
+	if (map_bmsg_is_sms (parser)) {
+		if (!parser->sms_stream && !map_sms_begin (parser))
+			return;
+		stream = parser->sms_stream;
+	}
+
+	if (camel_stream_write (stream, data, len, NULL, &parser->error) < 0 && !parser->error)
+		g_set_error (
+			&parser->error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Unable to write message to the cache"));
+}
+
+static gboolean
+map_bmsg_line_is (const gchar *line,
+		  gsize len,
+		  const gchar *keyword)
+{
+	gsize klen = strlen (keyword);
+
+	while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		len--;
+
+	return len == klen && g_ascii_strncasecmp (line, keyword, klen) == 0;
+}
+
+/* Returns the value of a "NAME:value" line, or NULL */
+static gchar *
+map_bmsg_line_value (const gchar *line,
+		     gsize len,
+		     const gchar *name)
+{
+	gsize nlen = strlen (name);
+
+	if (len <= nlen || line[nlen] != ':' || g_ascii_strncasecmp (line, name, nlen) != 0)
+		return NULL;
+
+	line += nlen + 1;
+	len -= nlen + 1;
+	while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		len--;
+
+	return g_strndup (line, len);
+}
+
+/* Settles a held END:MSG line, as content or as the end marker */
+static void
+map_bmsg_release_held (MapBMsgParser *parser,
+		       gboolean is_content)
+{
+	if (!parser->held)
+		return;
+
+	if (is_content)
+		map_bmsg_emit (parser, parser->held, parser->held_len);
+	g_free (parser->held);
+	parser->held = NULL;
+	parser->held_len = 0;
+}
+
+/* Handles a complete line; parser->offset is already past it */
+static void
+map_bmsg_process_line (MapBMsgParser *parser,
+		       const gchar *line,
+		       gsize len)
+{
+	gchar *value;
+
+	switch (parser->state) {
+	case MAP_BMSG_STATE_ENVELOPE:
+		if (map_bmsg_line_is (line, len, "BEGIN:BBODY"))
+			parser->state = MAP_BMSG_STATE_BODY;
+		else if (!parser->type && (value = map_bmsg_line_value (line, len, "TYPE")))
+			parser->type = value;
+		break;
+	case MAP_BMSG_STATE_BODY:
+		if (map_bmsg_line_is (line, len, "BEGIN:MSG")) {
+			/* Only a count that fits in the file is worth trusting */
+			if (!parser->n_parts && parser->length &&
+			    parser->offset - len + parser->length <= parser->size)
+				parser->msg_end = parser->offset - len + parser->length;
+			parser->state = MAP_BMSG_STATE_MSG;
+			parser->n_parts++;
+		} else if (map_bmsg_line_is (line, len, "END:BBODY")) {
+			parser->state = MAP_BMSG_STATE_DONE;
+		} else if ((value = map_bmsg_line_value (line, len, "CHARSET"))) {
+			g_free (parser->charset);
+			parser->charset = value;
+		} else if ((value = map_bmsg_line_value (line, len, "LENGTH"))) {
+			parser->length = g_ascii_strtoull (value, NULL, 10);
+			g_free (value);
+		}
+		break;
+	case MAP_BMSG_STATE_MSG:
+		/* Content ran past LENGTH, the device counted wrong */
+		if (parser->msg_end && parser->offset > parser->msg_end)
+			parser->msg_end = 0;
+
+		if (parser->held) {
+			if (map_bmsg_line_is (line, len, "BEGIN:MSG")) {
+				/* It separated two parts */
+				map_bmsg_release_held (parser, FALSE);
+				parser->n_parts++;
+				break;
+			} else if (map_bmsg_line_is (line, len, "END:BBODY")) {
+				/* LENGTH was too large */
+				map_bmsg_release_held (parser, FALSE);
+				parser->state = MAP_BMSG_STATE_DONE;
+				break;
+			}
+			map_bmsg_release_held (parser, TRUE);
+		}
+
+		if (map_bmsg_line_is (line, len, "END:MSG")) {
+			if (parser->msg_end && parser->offset == parser->msg_end) {
+				parser->state = MAP_BMSG_STATE_BODY;
+			} else {
+				parser->held = g_strndup (line, len);
+				parser->held_len = len;
+			}
+		} else {
+			map_bmsg_emit (parser, line, len);
+		}
+		break;
+	case MAP_BMSG_STATE_DONE:
+		break;
+	}
+}
+
+static void
+map_bmsg_parser_feed (MapBMsgParser *parser,
+		      const gchar *data,
+		      gsize len)
+{
+	while (len && !parser->error) {
+		const gchar *nl = memchr (data, '\n', len);
+		gsize n = nl ? nl - data + 1 : len;
+
+		parser->offset += n;
+
+		if (parser->passthrough) {
+			/* Rest of a long content line */
+			map_bmsg_emit (parser, data, n);
+			if (nl)
+				parser->passthrough = FALSE;
+		} else {
+			g_byte_array_append (parser->line, (const guint8 *) data, n);
+			if (nl) {
+				map_bmsg_process_line (parser, (const gchar *) parser->line->data, parser->line->len);
+				g_byte_array_set_size (parser->line, 0);
+			} else if (parser->state == MAP_BMSG_STATE_MSG &&
+				   parser->line->len > strlen ("END:BBODY\r")) {
+				/* Longer than any marker, don't hold on to it */
+				map_bmsg_release_held (parser, TRUE);
+				map_bmsg_emit (parser, (const gchar *) parser->line->data, parser->line->len);
+				g_byte_array_set_size (parser->line, 0);
+				parser->passthrough = TRUE;
+			}
+		}
+
+		data += n;
+		len -= n;
+	}
+}
+
+static gboolean
+map_bmsg_parse_file (MapBMsgParser *parser,
+		     const gchar *filename,
+		     GError **error)
+{
+	gchar buf[MAP_BMSG_CHUNK_SIZE];
+	struct stat st;
+	gssize n;
+	gint fd;
+
+	fd = g_open (filename, O_RDONLY, 0);
+	if (fd == -1) {
+		g_set_error (
+			error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			"%s: %s", filename, g_strerror (errno));
+		return FALSE;
+	}
+	if (fstat (fd, &st) == 0)
+		parser->size = st.st_size;
+
+	while (!parser->error && (n = read (fd, buf, sizeof (buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			g_set_error (
+				&parser->error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				"%s: %s", filename, g_strerror (errno));
+			break;
+		}
+		map_bmsg_parser_feed (parser, buf, n);
+	}
+	close (fd);
+
+	/* A last line without a newline */
+	if (!parser->error && parser->line->len)
+		map_bmsg_process_line (parser, (const gchar *) parser->line->data, parser->line->len);
+
+	/* Nothing came after it, so that was the end */
+	if (parser->held) {
+		map_bmsg_release_held (parser, FALSE);
+		parser->state = MAP_BMSG_STATE_BODY;
+	}
+
+	if (!parser->error && (!parser->n_parts || parser->state == MAP_BMSG_STATE_MSG))
+		g_set_error (
+			&parser->error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Invalid bMessage received from the device"));
+
+	if (parser->error) {
+		g_propagate_error (error, parser->error);
+		parser->error = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Completes an SMS entry, an empty one still gets its headers */
+static gboolean
+map_sms_finish (MapBMsgParser *parser,
+		GError **error)
+{
+	if (!parser->error && (parser->sms_stream || map_sms_begin (parser)) &&
+	    camel_stream_flush (parser->sms_stream, NULL, &parser->error) == -1 && !parser->error)
+		g_set_error (
+			&parser->error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Unable to write message to the cache"));
+
+	if (parser->error) {
+		g_propagate_error (error, parser->error);
+		parser->error = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Extracts the message from the bMessage in btmsg into cache_file. The
+ * entry is written under a temporary name and renamed into place, so
+ * readers never see half of it. */
+static gboolean
+parse_xbt_message (CamelFolder *folder,
+		   const char *btmsg,
+		   const char *cache_file,
+		   const char *uid,
+		   GError **error)
+{
+	MapBMsgParser parser = { 0 };
+	CamelMessageInfo *info;
+	gchar *tmp_file;
+	gboolean success;
+
+	tmp_file = map_folder_new_temp_file ((CamelMapFolder *) folder, "entry", error);
+	if (!tmp_file)
+		return FALSE;
+
+	parser.sink = camel_stream_fs_new_with_name (tmp_file, O_WRONLY | O_TRUNC, 0600, error);
+	if (!parser.sink) {
+		g_unlink (tmp_file);
+		g_free (tmp_file);
+		return FALSE;
+	}
+	parser.folder = folder;
+	parser.uid = uid;
+	info = camel_folder_summary_get (folder->summary, uid);
+	if (info) {
+		parser.listed_type = ((CamelMapMessageInfo *) info)->type;
+		camel_message_info_free (info);
+	}
+	parser.line = g_byte_array_new ();
+
+	success = map_bmsg_parse_file (&parser, btmsg, error);
+
+	if (success && map_bmsg_is_sms (&parser))
+		success = map_sms_finish (&parser, error);
+	if (parser.sms_stream)
+		g_object_unref (parser.sms_stream);
+
+	if (success && camel_stream_close (parser.sink, NULL, error) == -1)
+		success = FALSE;
+	g_object_unref (parser.sink);
+
+	if (success && g_rename (tmp_file, cache_file) == -1) {
+		g_set_error (
+			error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			"%s: %s", cache_file, g_strerror (errno));
+		success = FALSE;
+	}
+	if (!success)
+		g_unlink (tmp_file);
+
+	g_byte_array_free (parser.line, TRUE);
+	g_free (parser.type);
+	g_free (parser.charset);
+	g_free (parser.held);
+	g_free (tmp_file);
+
+	return success;
+}
+
+/* Downloads the message into the cache, in full or as a preview
+ * without attachments. If another thread is already fetching it, waits
+ * for that fetch and only goes to the device if it didn't leave the
+ * variant we need behind. */
+static gboolean
+map_folder_download_message (CamelFolder *folder,
+			     const gchar *uid,
+			     gboolean attachments,
+			     CamelMapOperationPriority priority,
+			     GCancellable *cancellable,
+			     GError **error)
+{
+	CamelMapFolder *map_folder;
+	CamelMapFolderPrivate *priv;
+	CamelMapStore *map_store;
+	gchar *mime_dir;
+	gchar *cache_file;
+	gchar *dir;
+	const gchar *temp;
+	gboolean res = FALSE;
+	gboolean waited = FALSE;
+	GError *local_error = NULL;
+	gchar *msg_id;
+	GDBusProxy *map;
+	
+	map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
+	map_folder = (CamelMapFolder *) folder;
+	priv = map_folder->priv;
+
+	map = map_folder_ref_proxy (map_folder, error);
+	if (!map)
+		return FALSE;
+
+	g_mutex_lock (priv->state_lock);
+	
+	/* If another thread is already fetching this message, wait for it */
+
+	/* FIXME: We might end up refetching a message anyway, if another
+	 * thread has already finished fetching it by the time we get to
+	 * this point in the code — map_folder_get_message_sync() doesn't
+	 * hold any locks when it calls get_message_from_cache() and then
+	 * falls back to this function. */
+	while (g_hash_table_lookup (priv->uid_eflags, uid)) {
+		waited = TRUE;
+		g_cond_wait (priv->fetch_cond, priv->state_lock);
+	}
+
+	if (waited &&
+	    (map_folder_has_cached_variant (map_folder, MAP_CACHE_FULL, uid) ||
+	     (!attachments && map_folder_has_cached_variant (map_folder, MAP_CACHE_PARTIAL, uid)))) {
+		g_mutex_unlock (priv->state_lock);
+		g_object_unref (map);
+
+		return TRUE;
+	}
+
+	/* Because we're using this as a form of mutex, we *know* that
+	 * we won't be inserting where an entry already exists. So it's
+	 * OK to insert uid itself, not g_strdup (uid) */
+	g_hash_table_insert (priv->uid_eflags, (gchar *) uid, (gchar *) uid);
+	g_mutex_unlock (priv->state_lock);
+
+	mime_dir = map_folder_new_temp_file (map_folder, "bt-message", error);
+	if (!mime_dir) {
+		g_mutex_lock (priv->state_lock);
+		g_hash_table_remove (priv->uid_eflags, uid);
+		g_mutex_unlock (priv->state_lock);
+		g_cond_broadcast (priv->fetch_cond);
+		g_object_unref (map);
+
+		return FALSE;
+	}
+
+	camel_map_store_folder_lock (map_store, priority, priv->map_dir);
+
+	cache_file = camel_data_cache_get_filename (
+		map_folder->cache, attachments ? MAP_CACHE_FULL : MAP_CACHE_PARTIAL, uid);
+	temp = g_strrstr (cache_file, "/");
+	dir = g_strndup (cache_file, temp - cache_file);
+	if (g_mkdir_with_parents (dir, 0700) == -1) {
+		g_set_error (
+			error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Unable to create cache path"));
+		g_free (dir);
+		goto exit;
+	}
+	g_free (dir);
+
+	msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
+	
+	if (!camel_map_store_set_current_folder (map_store, map_folder->priv->map_dir, cancellable, error)) {
+		g_free (msg_id);
+		goto exit;
+	}
+	printf("Objid: %s\n", msg_id);
+	
+	res = camel_map_dbus_get_message (map,
+					  msg_id,
+					  mime_dir,
+					  attachments,
+					  cancellable,
+					  &local_error);
+	g_free (msg_id);
+
+	/* The device is done with us, don't hold up other folders
+	 * while the message is converted */
+	camel_map_store_folder_unlock (map_store);
+
+	if (!res) {
+		g_propagate_error (error, local_error);
+		goto done;
+	}
+
+	res = parse_xbt_message (folder, mime_dir, cache_file, uid, error);
+
+	/* The full message supersedes the preview */
+	if (res && attachments)
+		camel_data_cache_remove (map_folder->cache, MAP_CACHE_PARTIAL, uid, NULL);
+
+	goto done;
+
+exit:
+	camel_map_store_folder_unlock (map_store);
+
+done:
+	g_mutex_lock (priv->state_lock);
+	g_hash_table_remove (priv->uid_eflags, uid);
+	g_mutex_unlock (priv->state_lock);
+	g_cond_broadcast (priv->fetch_cond);
+
+	g_unlink (mime_dir);
+	g_free (mime_dir);
+	g_free (cache_file);
+	g_object_unref (map);
+	
+	return res;
+}
+
+static CamelMimeMessage *
+camel_map_folder_get_message (CamelFolder *folder,
+                              const gchar *uid,
+                              gboolean attachments,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+	CamelMimeMessage *message = NULL;
+
+	if (map_folder_download_message (folder, uid, attachments, CAMEL_MAP_OPERATION_FOREGROUND, cancellable, error))
+		message = map_folder_get_message_from_cache_path (
+			(CamelMapFolder *) folder,
+			attachments ? MAP_CACHE_FULL : MAP_CACHE_PARTIAL,
+			uid, cancellable, error);
+
+	if (!message && error && !*error)
+		g_set_error (
+			error, CAMEL_ERROR, 1,
+			"Could not retrieve the message");
+
+	return message;
+}
+
+typedef struct _MapFetchJob {
+	guint index;
+	const gchar *uid;
+	gchar *msg_id;
+	gchar *bt_file;
+	gchar *cache_file;
+	CamelMapTransfer *transfer;
+	gboolean parsing;	/* queued on the parse pool */
+	GError *error;
+} MapFetchJob;
+
+static void
+map_clear_error (gpointer data)
+{
+	if (data)
+		g_error_free (data);
+}
+
+/* Runs on the parse pool */
+static void
+map_folder_parse_job (gpointer data,
+		      gpointer user_data)
+{
+	MapFetchJob *job = data;
+	CamelMapFolder *map_folder = user_data;
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	GError *local_error = NULL;
+
+	if (parse_xbt_message ((CamelFolder *) map_folder, job->bt_file, job->cache_file, job->uid, &local_error)) {
+		g_static_rec_mutex_lock (&priv->cache_lock);
+		camel_data_cache_remove (map_folder->cache, MAP_CACHE_PARTIAL, job->uid, NULL);
+		g_static_rec_mutex_unlock (&priv->cache_lock);
+	}
+
+	g_mutex_lock (priv->state_lock);
+	job->error = local_error;
+	job->parsing = FALSE;
+	g_cond_broadcast (priv->fetch_cond);
+	g_mutex_unlock (priv->state_lock);
+}
+
+/* Expects the store folder lock to be held. Each finished transfer is
+ * handed to the parse pool right away. */
+static void
+map_folder_run_fetch_pipeline (CamelMapFolder *map_folder,
+			       GDBusProxy *map,
+			       MapFetchJob *jobs,
+			       guint n_jobs,
+			       GCancellable *cancellable)
+{
+	guint started = 0, finished = 0;
+
+	while (finished < n_jobs) {
+		MapFetchJob *job;
+
+		/* Keep the session busy while we wait for the oldest one */
+		while (started < n_jobs && started - finished < MAP_FETCH_PIPELINE_DEPTH) {
+			job = &jobs[started++];
+			if (job->error || g_cancellable_set_error_if_cancelled (cancellable, &job->error))
+				continue;
+
+			printf("Objid: %s\n", job->msg_id);
+			job->transfer = camel_map_dbus_start_get_message (map,
+									  job->msg_id,
+									  job->bt_file,
+									  TRUE,
+									  cancellable,
+									  &job->error);
+		}
+
+		job = &jobs[finished++];
+		if (job->transfer) {
+			camel_map_dbus_finish_transfer (job->transfer, &job->error);
+			job->transfer = NULL;
+
+			if (!job->error) {
+				job->parsing = TRUE;
+				g_thread_pool_push (map_folder->priv->parse_pool, job, NULL);
+			}
+		}
+	}
+}
+
+/**
+ * camel_map_folder_fetch_messages:
+ * @map_folder: a #CamelMapFolder
+ * @uids: uids of the messages to download
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Downloads the messages in @uids that are not cached yet. The folder
+ * is selected once and the Gets are queued on the session back to
+ * back; the downloaded bMessages are converted on a small thread pool
+ * while the remaining transfers run.
+ *
+ * Returns: an array as long as @uids holding the #GError for each
+ * message that could not be fetched and %NULL for each message that is
+ * now in the cache, or %NULL if nothing could be fetched at all, in
+ * which case @error is set. Free with g_ptr_array_unref().
+ **/
+GPtrArray *
+camel_map_folder_fetch_messages (CamelMapFolder *map_folder,
+				 GPtrArray *uids,
+				 GCancellable *cancellable,
+				 GError **error)
+{
+	CamelFolder *folder = (CamelFolder *) map_folder;
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	CamelMapStore *map_store;
+	GDBusProxy *map;
+	GPtrArray *statuses;
+	GArray *waiting;
+	MapFetchJob *jobs;
+	guint n_jobs = 0;
+	gint i;
+
+	map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
+
+	map = map_folder_ref_proxy (map_folder, error);
+	if (!map)
+		return NULL;
+
+	statuses = g_ptr_array_new_with_free_func (map_clear_error);
+	g_ptr_array_set_size (statuses, uids->len);
+	waiting = g_array_new (FALSE, FALSE, sizeof (guint));
+	jobs = g_new0 (MapFetchJob, uids->len);
+
+	/* Claim everything that isn't cached or being fetched already */
+	g_mutex_lock (priv->state_lock);
+	for (i = 0; i < uids->len; i++) {
+		const gchar *uid = uids->pdata[i];
+		MapFetchJob *job;
+		gchar *dir;
+		guint index = i;
+
+		if (camel_map_folder_is_message_cached (map_folder, uid))
+			continue;
+
+		if (g_hash_table_lookup (priv->uid_eflags, uid)) {
+			g_array_append_val (waiting, index);
+			continue;
+		}
+
+		g_hash_table_insert (priv->uid_eflags, (gchar *) uid, (gchar *) uid);
+
+		job = &jobs[n_jobs++];
+		job->index = index;
+		job->uid = uid;
+		job->msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
+		job->bt_file = map_folder_new_temp_file (map_folder, "bt-message", &job->error);
+		job->cache_file = camel_data_cache_get_filename (map_folder->cache, MAP_CACHE_FULL, uid);
+
+		dir = g_path_get_dirname (job->cache_file);
+		if (!job->error && g_mkdir_with_parents (dir, 0700) == -1)
+			g_set_error (
+				&job->error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+				_("Unable to create cache path"));
+		g_free (dir);
+	}
+	g_mutex_unlock (priv->state_lock);
+
+	if (n_jobs) {
+		GError *local_error = NULL;
+
+		camel_map_store_folder_lock (map_store, CAMEL_MAP_OPERATION_PREFETCH, priv->map_dir);
+
+		if (camel_map_store_set_current_folder (map_store, priv->map_dir, cancellable, &local_error)) {
+			map_folder_run_fetch_pipeline (map_folder, map, jobs, n_jobs, cancellable);
+		} else {
+			for (i = 0; i < n_jobs; i++) {
+				if (!jobs[i].error)
+					jobs[i].error = g_error_copy (local_error);
+			}
+			g_clear_error (&local_error);
+		}
+
+		camel_map_store_folder_unlock (map_store);
+	}
+
+	/* Wait for the conversions still running */
+	g_mutex_lock (priv->state_lock);
+	for (i = 0; i < n_jobs; i++) {
+		while (jobs[i].parsing)
+			g_cond_wait (priv->fetch_cond, priv->state_lock);
+	}
+	g_mutex_unlock (priv->state_lock);
+
+	for (i = 0; i < n_jobs; i++) {
+		MapFetchJob *job = &jobs[i];
+
+		if (job->bt_file)
+			g_unlink (job->bt_file);
+
+		statuses->pdata[job->index] = job->error;
+
+		g_free (job->msg_id);
+		g_free (job->bt_file);
+		g_free (job->cache_file);
+	}
+
+	g_mutex_lock (priv->state_lock);
+	for (i = 0; i < n_jobs; i++)
+		g_hash_table_remove (priv->uid_eflags, jobs[i].uid);
+	g_cond_broadcast (priv->fetch_cond);
+
+	/* Messages another thread was fetching when we started */
+	for (i = 0; i < waiting->len; i++) {
+		guint index = g_array_index (waiting, guint, i);
+		const gchar *uid = uids->pdata[index];
+
+		while (g_hash_table_lookup (priv->uid_eflags, uid))
+			g_cond_wait (priv->fetch_cond, priv->state_lock);
+
+		if (!camel_map_folder_is_message_cached (map_folder, uid))
+			statuses->pdata[index] = g_error_new (
+				CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+				"Could not retrieve the message");
+	}
+	g_mutex_unlock (priv->state_lock);
+
+	g_array_free (waiting, TRUE);
+	g_free (jobs);
+	g_object_unref (map);
 
-	return msg;
+	return statuses;
+}
+
+typedef struct _MapFractionJob {
+	CamelMapFolder *map_folder;
+	gchar *uid;
+} MapFractionJob;
+
+static gchar *
+map_folder_fraction_file (CamelMapFolder *map_folder,
+			  const gchar *uid,
+			  const gchar *suffix)
+{
+	return g_strdup_printf ("%s/%s/fraction-%s%s", camel_data_cache_get_path (map_folder->cache), MAP_CACHE_TMP, uid, suffix);
 }
 
 static gboolean
-parse_xbt_message (CamelFolder *folder,
-		   const char *btmsg,
-		   const char *cache_file,
-		   const char *uid,
-		   GError **error)
+map_copy_file (const gchar *from,
+	       const gchar *to,
+	       gboolean append,
+	       GError **error)
 {
-	char *bt_message = NULL;
-	char *mime_message = NULL, *end;
+	gchar *contents;
 	gsize len;
-	
-	if (!g_file_get_contents (btmsg, &bt_message, &len, error))
+	FILE *fp;
+	gboolean success;
+
+	if (!g_file_get_contents (from, &contents, &len, error))
 		return FALSE;
 
-	/* Handle separately for SMS, MMS & EMail */
-	
-//	mime_message = bt_message;
-//	mime_message = g_strstr_len (bt_message, -1, "BEGIN:MSG");
-//	mime_message += strlen ("BEGIN:MSG")+1;
-	if (strstr(bt_message, "MIME-Version:") != 0) {
-		/* This is a email*/
-		end = g_strstr_len (bt_message, -1, "END:MSG");
-		*end = '\0';
-	} else {
-		/* This is a SMS.*/
-		CamelMessageInfoBase *info;
-		CamelMimeMessage *msg;
-		CamelInternetAddress *addr;
-		char *str;
-		char *begin, *end;
-		CamelStream *stream, *base_stream;
-		GByteArray *byte_array;
-		CamelDataWrapper *content;
-		char *from_line;
-		CamelMimeFilter *filter;
-		
-		info = (CamelMessageInfoBase *) camel_folder_summary_get (folder->summary, uid);
-		msg = camel_mime_message_new ();
-		camel_mime_message_set_subject (msg, info->subject);
-		addr = camel_internet_address_new ();
-		camel_address_decode (CAMEL_ADDRESS (addr), info->from);
-		camel_mime_message_set_from (msg, addr);
-		g_object_unref (addr);
-		camel_mime_message_set_date (msg, info->date_sent, 0);
-
-		str = g_strdup_printf("camel-%s-%ld-%s-%d", camel_folder_get_display_name(folder), info->date_sent, uid, g_random_int());
-		camel_mime_message_set_message_id (msg, str);
-		g_free (str);
-		
-		begin = g_strstr_len (bt_message, -1, "BEGIN:MSG");
-		begin += strlen ("BEGIN:MSG")+1;
-		end = g_strstr_len (bt_message, -1, "END:MSG");
-		*end = '\0';
-
-		camel_mime_part_set_content (CAMEL_MIME_PART (msg), begin, strlen (begin), "text/plain");
-		
-		byte_array = g_byte_array_new ();
-		base_stream = camel_stream_mem_new_with_byte_array (byte_array);
-		from_line = camel_mime_message_build_mbox_from (msg);
-		camel_stream_write (base_stream, from_line, strlen (from_line), NULL, NULL);
-
-		filter = camel_mime_filter_from_new ();
-		stream = camel_stream_filter_new (base_stream);
-		camel_stream_filter_add (CAMEL_STREAM_FILTER (stream), filter);
-
-		camel_data_wrapper_write_to_stream_sync (
-			CAMEL_DATA_WRAPPER (msg),
-			stream, NULL, NULL);
-
-		g_free (bt_message);
-		g_object_unref (filter);
-		g_object_unref (stream);
-
-		bt_message = g_strndup ((gchar *) byte_array->data, byte_array->len);
-		g_object_unref (base_stream);
-		g_object_unref (msg);
-		
-		
+	if (!append) {
+		success = g_file_set_contents (to, contents, len, error);
+		g_free (contents);
+		return success;
 	}
 
-	if (!g_file_set_contents (cache_file, bt_message, -1, error)) {
-		g_free (bt_message);
-		return FALSE;
-	}
-	
-	g_free (bt_message);
-	
-	return TRUE;
+	fp = g_fopen (to, "ab");
+	success = fp && fwrite (contents, 1, len, fp) == len;
+	if (fp && fclose (fp) != 0)
+		success = FALSE;
+	if (!success)
+		g_set_error (
+			error, G_FILE_ERROR, g_file_error_from_errno (errno),
+			"%s: %s", to, g_strerror (errno));
+	g_free (contents);
+
+	return success;
 }
 
-static CamelMimeMessage *
-camel_map_folder_get_message (CamelFolder *folder,
-                              const gchar *uid,
-                              GCancellable *cancellable,
-                              GError **error)
+/* Fetches one fraction of the message and appends its payload to the
+ * fraction file of uid, which ends up holding the whole message. */
+static gboolean
+map_folder_fetch_fraction (CamelMapFolder *map_folder,
+			   const gchar *uid,
+			   gboolean next,
+			   gboolean *more,
+			   GCancellable *cancellable,
+			   GError **error)
 {
-	CamelMapFolder *map_folder;
-	CamelMapFolderPrivate *priv;
+	CamelFolder *folder = (CamelFolder *) map_folder;
 	CamelMapStore *map_store;
-	CamelMimeMessage *message = NULL;
-	CamelStream *tmp_stream = NULL;
-	GSList *ids = NULL, *items = NULL;
-	gchar *mime_dir;
-	gchar *cache_file;
-	gchar *dir;
-	const gchar *temp;
-	gboolean res;
-	gchar *mime_fname_new = NULL;
-	GError *local_error = NULL;
-	gchar *msg_id;
-	
-	map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
-	map_folder = (CamelMapFolder *) folder;
-	priv = map_folder->priv;
+	CamelMapTransfer *transfer;
+	GDBusProxy *map;
+	gchar *bt_file, *part_file, *fraction_file, *msg_id;
+	gboolean success = FALSE;
 
-	g_mutex_lock (priv->state_lock);
-	
-	/* If another thread is already fetching this message, wait for it */
+	map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
 
-	/* FIXME: We might end up refetching a message anyway, if another
-	 * thread has already finished fetching it by the time we get to
-	 * this point in the code — map_folder_get_message_sync() doesn't
-	 * hold any locks when it calls get_message_from_cache() and then
-	 * falls back to this function. */
-	if (g_hash_table_lookup (priv->uid_eflags, uid)) {
-		do {
-			g_cond_wait (priv->fetch_cond, priv->state_lock);
-		} while (g_hash_table_lookup (priv->uid_eflags, uid));
+	map = map_folder_ref_proxy (map_folder, error);
+	if (!map)
+		return FALSE;
 
-		g_mutex_unlock (priv->state_lock);
+	bt_file = map_folder_new_temp_file (map_folder, "bt-message", error);
+	if (!bt_file) {
+		g_object_unref (map);
+		return FALSE;
+	}
+	part_file = map_folder_fraction_file (map_folder, uid, ".part");
+	fraction_file = map_folder_fraction_file (map_folder, uid, "");
+	msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
 
-		message = camel_map_folder_get_message_from_cache (map_folder, uid, cancellable, error);
-		return message;
+	camel_map_store_folder_lock (map_store, CAMEL_MAP_OPERATION_FOREGROUND, map_folder->priv->map_dir);
+	if (camel_map_store_set_current_folder (map_store, map_folder->priv->map_dir, cancellable, error)) {
+		transfer = camel_map_dbus_start_get_message_fraction (map, msg_id, bt_file, next, more, cancellable, error);
+		if (transfer)
+			success = camel_map_dbus_finish_transfer (transfer, error);
 	}
+	camel_map_store_folder_unlock (map_store);
 
-	/* Because we're using this as a form of mutex, we *know* that
-	 * we won't be inserting where an entry already exists. So it's
-	 * OK to insert uid itself, not g_strdup (uid) */
-	g_hash_table_insert (priv->uid_eflags, (gchar *) uid, (gchar *) uid);
-	g_mutex_unlock (priv->state_lock);
+	if (success)
+		success = parse_xbt_message (folder, bt_file, part_file, uid, error);
+	if (success)
+		success = map_copy_file (part_file, fraction_file, next, error);
 
-	camel_map_store_folder_lock (map_store);
-	
-	ids = g_slist_append (ids, (gchar *) uid);
+	g_unlink (bt_file);
+	g_unlink (part_file);
+	g_free (bt_file);
+	g_free (part_file);
+	g_free (fraction_file);
+	g_free (msg_id);
+	g_object_unref (map);
 
-	mime_dir = g_build_filename (
-		camel_data_cache_get_path (map_folder->cache),
-		"bt-message", NULL);
+	return success;
+}
 
-	cache_file = map_data_cache_get_filename (
-		map_folder->cache, "cur", uid, error);
-	temp = g_strrstr (cache_file, "/");
-	dir = g_strndup (cache_file, temp - cache_file);
+/* Stores what was collected so far as the preview, or as the full
+ * message once the last fraction is in. */
+static gboolean
+map_folder_store_fractions (CamelMapFolder *map_folder,
+			    const gchar *uid,
+			    gboolean complete,
+			    GError **error)
+{
+	gchar *fraction_file, *cache_file, *dir;
+	gboolean success;
+
+	fraction_file = map_folder_fraction_file (map_folder, uid, "");
+	cache_file = camel_data_cache_get_filename (
+		map_folder->cache, complete ? MAP_CACHE_FULL : MAP_CACHE_PARTIAL, uid);
+
+	/* The data cache leaves creating its buckets to the writer */
+	dir = g_path_get_dirname (cache_file);
 	if (g_mkdir_with_parents (dir, 0700) == -1) {
 		g_set_error (
 			error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
 			_("Unable to create cache path"));
 		g_free (dir);
+		g_free (fraction_file);
 		g_free (cache_file);
-		goto exit;
+		return FALSE;
 	}
-
-	msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
-	
-	if (!camel_map_store_set_current_folder (map_store, map_folder->priv->map_dir, cancellable, error)) {
-		g_propagate_error (error, local_error);
-		goto exit;
+	g_free (dir);
+
+	g_static_rec_mutex_lock (&map_folder->priv->cache_lock);
+	if (complete) {
+		/* Nothing more will be appended, move it into place */
+		success = g_rename (fraction_file, cache_file) == 0;
+		if (!success)
+			g_set_error (
+				error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				"%s: %s", cache_file, g_strerror (errno));
+		else
+			camel_data_cache_remove (map_folder->cache, MAP_CACHE_PARTIAL, uid, NULL);
+	} else {
+		success = map_copy_file (fraction_file, cache_file, FALSE, error);
 	}
-	printf("Objid: %s\n", msg_id);
-	
-	res = camel_map_dbus_get_message (map_folder->priv->map,
-					  msg_id,
-					  mime_dir,
-					  cancellable,
-					  &local_error);
+	g_static_rec_mutex_unlock (&map_folder->priv->cache_lock);
 
-	if (!res) {
-		g_propagate_error (error, local_error);
-		goto exit;
-	}
+	g_free (fraction_file);
+	g_free (cache_file);
 
-	if (!parse_xbt_message (folder, mime_dir, cache_file, uid, &local_error)) {
-		g_propagate_error (error, local_error);
-		goto exit;
-	}
+	return success;
+}
 
-	message = camel_map_folder_get_message_from_cache (map_folder, uid, cancellable, error);
+static void
+map_fraction_job_free (MapFractionJob *job)
+{
+	CamelMapFolderPrivate *priv = job->map_folder->priv;
 
-exit:
-	camel_map_store_folder_unlock (map_store);
-	
 	g_mutex_lock (priv->state_lock);
-	g_hash_table_remove (priv->uid_eflags, uid);
+	g_hash_table_remove (priv->uid_eflags, job->uid);
 	g_mutex_unlock (priv->state_lock);
 	g_cond_broadcast (priv->fetch_cond);
 
-	if (!message && !error)
-		g_set_error (
-			error, CAMEL_ERROR, 1,
-			"Could not retrieve the message");
-	if (ids)
-		g_slist_free (ids);
-	if (items) {
-		g_object_unref (items->data);
-		g_slist_free (items);
+	g_object_unref (job->map_folder);
+	g_free (job->uid);
+	g_free (job);
+}
+
+/* Pulls the remaining fractions in the background. The uid stays
+ * claimed meanwhile, so a full fetch of the same message waits for
+ * this one instead of starting over. */
+static void
+map_folder_fraction_job (CamelSession *session,
+			 GCancellable *cancellable,
+			 MapFractionJob *job,
+			 GError **error)
+{
+	gchar *fraction_file;
+	gboolean more = TRUE;
+
+	while (more) {
+		if (!map_folder_fetch_fraction (job->map_folder, job->uid, TRUE, &more, cancellable, error)) {
+			/* The preview stays, a full fetch can still be done later */
+			fraction_file = map_folder_fraction_file (job->map_folder, job->uid, "");
+			g_unlink (fraction_file);
+			g_free (fraction_file);
+			return;
+		}
 	}
 
-	if (tmp_stream)
-		g_object_unref (tmp_stream);
+	map_folder_store_fractions (job->map_folder, job->uid, TRUE, error);
+}
+
+/* Fetches the first fraction of a large email and returns it for
+ * display right away; the rest follows in the background. */
+static CamelMimeMessage *
+map_folder_get_message_fractional (CamelFolder *folder,
+				   const gchar *uid,
+				   GCancellable *cancellable,
+				   GError **error)
+{
+	CamelMapFolder *map_folder = (CamelMapFolder *) folder;
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	CamelMimeMessage *message = NULL;
+	MapFractionJob *job;
+	gboolean more = FALSE;
+
+	job = g_new0 (MapFractionJob, 1);
+	job->map_folder = g_object_ref (map_folder);
+	job->uid = g_strdup (uid);
+
+	g_mutex_lock (priv->state_lock);
+	while (g_hash_table_lookup (priv->uid_eflags, uid))
+		g_cond_wait (priv->fetch_cond, priv->state_lock);
+	g_hash_table_insert (priv->uid_eflags, job->uid, job->uid);
+	g_mutex_unlock (priv->state_lock);
+
+	if (map_folder_fetch_fraction (map_folder, uid, FALSE, &more, cancellable, error) &&
+	    map_folder_store_fractions (map_folder, uid, !more, error))
+		message = map_folder_get_message_from_cache_path (
+			map_folder, more ? MAP_CACHE_PARTIAL : MAP_CACHE_FULL,
+			uid, cancellable, error);
+
+	if (message && more) {
+		camel_session_submit_job (
+			camel_service_get_session (CAMEL_SERVICE (camel_folder_get_parent_store (folder))),
+			(CamelSessionCallback) map_folder_fraction_job,
+			job,
+			(GDestroyNotify) map_fraction_job_free);
+	} else {
+		map_fraction_job_free (job);
+	}
 
-	if (mime_fname_new)
-		g_free (mime_fname_new);
-	
 	return message;
 }
 
@@ -489,11 +1512,67 @@ map_folder_get_message_sync (CamelFolder *folder,
                              GCancellable *cancellable,
                              GError **error)
 {
+	CamelMapFolder *map_folder = (CamelMapFolder *) folder;
+	CamelMapStore *map_store;
 	CamelMimeMessage *message;
+	CamelMessageInfo *info;
+	gboolean attachments = TRUE, fractions = TRUE, fractioned = FALSE;
+	GError *local_error = NULL;
+
+	/* A cached preview is served as it is, the message is asked for
+	 * several times while it is shown and replied to. The attachments
+	 * come in through synchronize_message(), which saving and going
+	 * offline use, or camel_map_folder_get_full_message(). */
+	message = camel_map_folder_get_message_from_cache (map_folder, uid, cancellable, NULL);
+	if (!message) {
+		/* Reading only needs the preview */
+		info = camel_folder_summary_get (folder->summary, uid);
+		if (info) {
+			CamelMapMessageInfo *minfo = (CamelMapMessageInfo *) info;
+
+			/* An SMS has no attachments to leave out, and only
+			 * email is delivered in fractions */
+			switch (minfo->type) {
+			case CAMEL_MAP_MESSAGE_TYPE_SMS_GSM:
+			case CAMEL_MAP_MESSAGE_TYPE_SMS_CDMA:
+				fractions = FALSE;
+				break;
+			case CAMEL_MAP_MESSAGE_TYPE_MMS:
+				fractions = FALSE;
+				/* fall through */
+			default:
+				attachments = ((CamelMessageInfoBase *) info)->size < MAP_PREVIEW_MIN_SIZE;
+				break;
+			}
+
+			/* The device holds only part of it itself, asking
+			 * for the further fractions gets it the rest */
+			fractioned = fractions && minfo->status == CAMEL_MAP_MESSAGE_STATUS_FRACTIONED;
+			camel_message_info_free (info);
+		}
+
+		map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
 
-	message = camel_map_folder_get_message_from_cache ((CamelMapFolder *) folder, uid, cancellable, NULL);
-	if (!message)
-		message = camel_map_folder_get_message (folder, uid, cancellable, error);
+		camel_map_store_begin_foreground_fetch (map_store);
+
+		/* Large messages render after the first fraction if the
+		 * daemon can deliver them that way */
+		if ((!attachments || fractioned) && fractions &&
+		    camel_map_store_get_fractions_supported (map_store)) {
+			message = map_folder_get_message_fractional (folder, uid, cancellable, &local_error);
+			if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+				camel_map_store_set_fractions_supported (map_store, FALSE);
+				g_clear_error (&local_error);
+			}
+		}
+
+		if (local_error)
+			g_propagate_error (error, local_error);
+		else if (!message)
+			message = camel_map_folder_get_message (folder, uid, attachments, cancellable, error);
+
+		camel_map_store_end_foreground_fetch (map_store);
+	}
 
 	return message;
 }
@@ -606,10 +1685,31 @@ map_synchronize_sync (CamelFolder *folder,
                       GCancellable *cancellable,
                       GError **error)
 {
-	if (expunge)
-		return map_folder_delete_messages (folder, cancellable, error);
-	
-	return TRUE;
+	CamelMapFolder *map_folder = (CamelMapFolder *) folder;
+	CamelMapStore *map_store;
+	GError *local_error = NULL;
+	gboolean success;
+
+	/* Don't leave flag changes waiting in the queue */
+	map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
+	camel_map_store_folder_lock (map_store, CAMEL_MAP_OPERATION_FLAGS, map_folder->priv->map_dir);
+	success = map_folder_flush_flags_cb (map_store, map_folder, cancellable, &local_error);
+	camel_map_store_folder_unlock (map_store);
+
+	/* Offline, they stay pending for the next connection */
+	if (g_error_matches (local_error, CAMEL_SERVICE_ERROR, CAMEL_SERVICE_ERROR_UNAVAILABLE)) {
+		g_clear_error (&local_error);
+		success = TRUE;
+	} else if (local_error) {
+		g_propagate_error (error, local_error);
+	}
+
+	if (success && expunge)
+		success = map_folder_delete_messages (folder, cancellable, error);
+
+	camel_map_folder_save_summary (map_folder);
+
+	return success;
 }
 
 #if 0
@@ -654,7 +1754,6 @@ map_folder_count_notify_cb (CamelFolderSummary *folder_summary,
 
 CamelFolder *
 camel_map_folder_new (CamelStore *store,
-		      GDBusProxy *map,
 		      const gchar *map_dir,
                       const gchar *folder_name,
                       const gchar *folder_dir,
@@ -689,7 +1788,6 @@ camel_map_folder_new (CamelStore *store,
 		return NULL;
 	}
 
-	map_folder->priv->map = g_object_ref (map);
 	map_folder->priv->map_dir = g_strdup (map_dir);
 
 	/* set/load persistent state */
@@ -704,6 +1802,14 @@ camel_map_folder_new (CamelStore *store,
 		return NULL;
 	}
 
+	camel_session_submit_job (
+		camel_service_get_session (CAMEL_SERVICE (store)),
+		(CamelSessionCallback) map_folder_migrate_cache_keys_job,
+		g_object_ref (map_folder),
+		(GDestroyNotify) g_object_unref);
+	map_folder_clear_temp_files (map_folder);
+	map_folder_journal_load (map_folder, folder_dir);
+
 	if (!g_ascii_strcasecmp (folder_name, "Inbox")) {
 		CamelSettings *settings;
 		gboolean filter_inbox;
@@ -732,6 +1838,130 @@ camel_map_folder_new (CamelStore *store,
 }
 
 
+/* Reads what the summary keeps of a message's listing entry into
+ * record. The fingerprint covers the properties that can change after
+ * the message arrived, so that unchanged entries can be skipped. */
+static void
+map_listing_read_record (const gchar *uid,
+			 GVariant *prop,
+			 CamelMapMessageInfo *record)
+{
+	const gchar *str;
+	gboolean read = FALSE, priority = FALSE;
+	guint64 size = 0;
+	guint32 hash = 5381;
+
+	record->handle = camel_map_uid_to_handle (uid);
+
+	record->type = CAMEL_MAP_MESSAGE_TYPE_UNKNOWN;
+	if (g_variant_lookup (prop, "Type", "&s", &str)) {
+		if (g_ascii_strcasecmp (str, "EMAIL") == 0)
+			record->type = CAMEL_MAP_MESSAGE_TYPE_EMAIL;
+		else if (g_ascii_strcasecmp (str, "SMS_GSM") == 0)
+			record->type = CAMEL_MAP_MESSAGE_TYPE_SMS_GSM;
+		else if (g_ascii_strcasecmp (str, "SMS_CDMA") == 0)
+			record->type = CAMEL_MAP_MESSAGE_TYPE_SMS_CDMA;
+		else if (g_ascii_strcasecmp (str, "MMS") == 0)
+			record->type = CAMEL_MAP_MESSAGE_TYPE_MMS;
+	}
+
+	record->status = CAMEL_MAP_MESSAGE_STATUS_UNKNOWN;
+	if (g_variant_lookup (prop, "Status", "&s", &str)) {
+		if (g_ascii_strcasecmp (str, "complete") == 0)
+			record->status = CAMEL_MAP_MESSAGE_STATUS_COMPLETE;
+		else if (g_ascii_strcasecmp (str, "fractioned") == 0)
+			record->status = CAMEL_MAP_MESSAGE_STATUS_FRACTIONED;
+		else if (g_ascii_strcasecmp (str, "notification") == 0)
+			record->status = CAMEL_MAP_MESSAGE_STATUS_NOTIFICATION;
+	}
+
+	g_variant_lookup (prop, "Read", "b", &read);
+	g_variant_lookup (prop, "Priority", "b", &priority);
+	g_variant_lookup (prop, "Size", "t", &size);
+
+	hash = hash * 33 + read;
+	hash = hash * 33 + priority;
+	hash = hash * 33 + record->status;
+	hash = hash * 33 + (guint32) (size ^ (size >> 32));
+	/* 0 is what rows from before fingerprints were kept have */
+	record->fingerprint = hash ? hash : 1;
+}
+
+static void
+map_message_info_set_record (CamelMapMessageInfo *info,
+			     const CamelMapMessageInfo *record)
+{
+	info->handle = record->handle;
+	info->type = record->type;
+	info->status = record->status;
+	info->fingerprint = record->fingerprint;
+}
+
+/* Brings the device's view of the folder up to date and lists it, under
+ * the store folder lock. Returns the a{oa{sv}} listing. */
+static GVariant *
+map_folder_list_messages (CamelMapFolder *map_folder,
+			  GDBusProxy *map,
+			  gboolean *initial_fetch,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	CamelMapStore *map_store;
+	GError *local_error = NULL;
+	GVariant *ret;
+
+	map_store = (CamelMapStore *) camel_folder_get_parent_store ((CamelFolder *) map_folder);
+
+	camel_map_store_folder_lock (map_store, CAMEL_MAP_OPERATION_REFRESH, "/telecom/msg");
+
+	if (!camel_map_store_update_inbox (map_store, cancellable, error)) {
+		if (!error || g_strstr_len((*error)->message, -1, "0x51") == 0) {
+			camel_map_store_folder_unlock (map_store);
+			if (error)
+				printf("FAILED UP in UPDATE INBOX: %s %x\n", (*error)->message, (*error)->code);
+			return NULL;
+		} else {
+			printf("Update INBOX not implemented by the device\n");
+			g_error_free (*error);
+			*error = NULL;
+		}
+	} else
+		printf("Successfully issued UpdateINBOX\n");
+
+
+	if (!camel_map_store_set_current_folder (map_store, "/telecom/msg", cancellable, error)) {
+		camel_map_store_folder_unlock (map_store);
+		return NULL;
+	}
+
+	ret = camel_map_dbus_get_message_listing (map,
+			camel_folder_get_full_name ((CamelFolder *) map_folder),
+			cancellable,
+			&local_error);
+	if (ret == NULL || local_error) {
+		printf("Unable to refresh folder: %s\n", local_error ? local_error->message : "Empty error msg");
+		g_propagate_error (error, local_error);
+		camel_map_store_folder_unlock (map_store);
+		if (ret)
+			g_variant_unref (ret);
+		if (error && !*error)
+			g_set_error (
+				error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+				_("Unable to list messages"));
+
+		return NULL;
+	}
+
+	/* Only during initial fetch, we can check for deleted messages */
+	*initial_fetch = camel_map_store_get_initial_fetch(map_store);
+	if (*initial_fetch)
+		camel_map_store_set_initial_fetch (map_store, FALSE);
+
+	camel_map_store_folder_unlock (map_store);
+
+	return ret;
+}
+
 static gboolean
 map_refresh_info_sync (CamelFolder *folder,
                        GCancellable *cancellable,
@@ -749,9 +1979,12 @@ map_refresh_info_sync (CamelFolder *folder,
 	GVariantIter top_iter, messages_iter, message_iter, prop_iter;
 	GHashTable *all_msgs;
 	CamelFolderChangeInfo *ci;
+	CamelMapMessageInfo record;
 	int i;
 	GPtrArray *uids;
 	gboolean initial_fetch;
+	GDBusProxy *map;
+	gint64 listing_time, last_listing_time;
 	
 	full_name = camel_folder_get_full_name (folder);
 	map_store = (CamelMapStore *) camel_folder_get_parent_store (folder);
@@ -759,67 +1992,39 @@ map_refresh_info_sync (CamelFolder *folder,
 	map_folder = (CamelMapFolder *) folder;
 	priv = map_folder->priv;
 
+	map = map_folder_ref_proxy (map_folder, error);
+	if (!map)
+		return FALSE;
+
 	g_mutex_lock (priv->state_lock);
 
 	if (priv->refreshing) {
 		g_mutex_unlock (priv->state_lock);
+		g_object_unref (map);
 		return TRUE;
 	}
 
 	priv->refreshing = TRUE;
 	g_mutex_unlock (priv->state_lock);
 	
-	camel_map_store_folder_lock (map_store);	
-
-	if (!camel_map_store_update_inbox (map_store, cancellable, error)) {
-		if (!error || g_strstr_len((*error)->message, -1, "0x51") == 0) {
-			camel_map_store_folder_unlock (map_store);
-			g_mutex_lock (priv->state_lock);
-			priv->refreshing = FALSE;
-			g_mutex_unlock (priv->state_lock);
-			if (error)
-				printf("FAILED UP in UPDATE INBOX: %s %x\n", (*error)->message, (*error)->code);
-			return FALSE;
-		} else {
-			printf("Update INBOX not implemented by the device\n");
-			g_error_free (*error);
-			*error = NULL;
-		}
-	} else
-		printf("Successfully issued UpdateINBOX\n");
-
-
-	if (!camel_map_store_set_current_folder (map_store, "/telecom/msg", cancellable, error)) {
-		camel_map_store_folder_unlock (map_store);
-		g_mutex_lock (priv->state_lock);
-		priv->refreshing = FALSE;
-		g_mutex_unlock (priv->state_lock);
-
-		return FALSE;
-	}
-
 	camel_folder_summary_prepare_fetch_all (folder->summary, NULL);
 
-	ret = camel_map_dbus_get_message_listing (map_folder->priv->map,
-			full_name,
-			cancellable,
-			&local_error);
-	if (ret == NULL || local_error) {
-		printf("Unable to refresh folder: %s\n", local_error ? local_error->message : "Empty error msg");
-		g_propagate_error (error, local_error);
-		camel_map_store_folder_unlock (map_store);
+	/* Whatever the device reports changed after the last listing */
+	last_listing_time = CAMEL_MAP_SUMMARY (folder->summary)->listing_time;
+	listing_time = g_get_real_time () / G_USEC_PER_SEC;
+
+	/* Device phase, the rest only touches the local summary and
+	 * doesn't need to keep other folders off the device */
+	ret = map_folder_list_messages (map_folder, map, &initial_fetch, cancellable, error);
+	if (!ret) {
 		g_mutex_lock (priv->state_lock);
 		priv->refreshing = FALSE;
 		g_mutex_unlock (priv->state_lock);
+		g_object_unref (map);
 
 		return FALSE;
 	}
 
-	/* Only during initial fetch, we can check for deleted messages */
-	initial_fetch = camel_map_store_get_initial_fetch(map_store);
-	if (initial_fetch)
-		camel_map_store_set_initial_fetch (map_store, FALSE);
-	
 	/* DBus message structure: a{oa{sv}} */
 	all_msgs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 	ci = camel_folder_change_info_new ();
@@ -844,14 +2049,20 @@ map_refresh_info_sync (CamelFolder *folder,
 			uid += strlen("message")+1;
 			printf("Message: %s: %s \t\t %s\n", msg_obj, uid, g_variant_print (prop, TRUE));
 			g_hash_table_insert (all_msgs, uid, msg_obj);
+			map_listing_read_record (uid, prop, &record);
 			
 			info = (CamelMessageInfoBase *)camel_folder_summary_get (folder->summary, uid);
-			if (info) {
+			if (info && ((CamelMapMessageInfo *) info)->fingerprint == record.fingerprint) {
+				/* Nothing the listing reports changed */
+				camel_message_info_free (info);
+			} else if (info) {
 				GVariant *item;
 				GVariant *value;
 				char *key;
 				CamelMessageFlags flags=0;
-				gboolean changed = FALSE;
+				guint32 pending, pending_value = 0;
+				gint64 pending_time = 0;
+				gboolean changed;
 				
 				/*Check if the message changed */
 				/*
@@ -899,15 +2110,26 @@ map_refresh_info_sync (CamelFolder *folder,
 					g_variant_unref (item);
 				}
 
-				if (((info->flags & CAMEL_MESSAGE_SEEN) != 0) !=  ((flags & CAMEL_MESSAGE_SEEN) != 0)) {
-					changed = TRUE;
-					camel_message_info_set_flags ((CamelMessageInfo *)info, CAMEL_MESSAGE_SEEN, (flags & CAMEL_MESSAGE_SEEN));
+				/* The last writer wins. A change the device
+				 * reports happened after the last listing, so
+				 * a pending change from before that is older
+				 * and is dropped. Otherwise the pending change
+				 * wins and the device side is kept as it was. */
+				pending = map_folder_get_pending_flags (map_folder, uid, &pending_value, &pending_time);
+				pending &= CAMEL_MESSAGE_SEEN;
+				if (pending && ((flags ^ ((CamelMapMessageInfo *) info)->server_flags) & pending) != 0 &&
+				    pending_time < last_listing_time) {
+					camel_map_folder_discard_flag_change (map_folder, uid, pending);
+					pending = 0;
 				}
+				flags = (flags & ~pending) | (((CamelMapMessageInfo *) info)->server_flags & pending);
 
-				if (((info->flags & CAMEL_MESSAGE_FLAGGED) != 0) != ((flags & CAMEL_MESSAGE_FLAGGED) != 0)) {
-					changed = TRUE;
-					camel_message_info_set_flags ((CamelMessageInfo *)info, CAMEL_MESSAGE_FLAGGED, (flags & CAMEL_MESSAGE_FLAGGED));
-				}
+				/* Only what changed on the device since the
+				 * last listing is applied, local changes stay */
+				changed = camel_map_update_message_info_flags (folder->summary, (CamelMessageInfo *) info, flags, NULL);
+
+				map_message_info_set_record ((CamelMapMessageInfo *) info, &record);
+				camel_folder_summary_touch (folder->summary);
 
 				if (changed) {
 					camel_folder_change_info_change_uid (ci, uid);
@@ -917,13 +2139,10 @@ map_refresh_info_sync (CamelFolder *folder,
 				/* Its a new message, lets add it to summary */
 				info = camel_message_info_new (folder->summary);
 				info->uid = camel_pstring_strdup (uid);
-				if (info->content == NULL) {
-					info->content =
-						camel_folder_summary_content_info_new (
-							folder->summary);
-					info->content->type =
-						camel_content_type_new ("multipart", "mixed");
-				}
+				map_message_info_set_record ((CamelMapMessageInfo *) info, &record);
+				/* The body isn't known until it is fetched */
+				if (info->content == NULL)
+					info->content = camel_map_summary_get_placeholder_content ();
 				g_variant_iter_init (&prop_iter, prop);
 				//g_variant_get (prop, "a{sv}", &prop_iter);
 				while ((item = g_variant_iter_next_value (&prop_iter))) {
@@ -931,16 +2150,21 @@ map_refresh_info_sync (CamelFolder *folder,
 
 					printf("Processing key: %s\n", key);
 
+					/* Record the device state first, so that
+					 * setting the flags isn't taken for a local
+					 * change that needs writing back */
 					if (strcmp (key, "Read") == 0) {
-						if (g_variant_get_boolean (value))
+						if (g_variant_get_boolean (value)) {
+							((CamelMapMessageInfo *) info)->server_flags |= CAMEL_MESSAGE_SEEN;
 							camel_message_info_set_flags ((CamelMessageInfo *)info, CAMEL_MESSAGE_SEEN, CAMEL_MESSAGE_SEEN);
-						else
+						} else
 							camel_message_info_set_flags ((CamelMessageInfo *)info, CAMEL_MESSAGE_SEEN, 0);
 											      
 					} else if (strcmp (key, "Priority") == 0) {
-						if (g_variant_get_boolean (value))
+						if (g_variant_get_boolean (value)) {
+							((CamelMapMessageInfo *) info)->server_flags |= CAMEL_MESSAGE_FLAGGED;
 							camel_message_info_set_flags ((CamelMessageInfo *)info, CAMEL_MESSAGE_FLAGGED, CAMEL_MESSAGE_FLAGGED);
-						else
+						} else
 							camel_message_info_set_flags ((CamelMessageInfo *)info, CAMEL_MESSAGE_FLAGGED, 0);
 					} else if (strcmp (key, "Size") == 0) {
 						info->size = (guint32) g_variant_get_uint64 (value);
@@ -1035,13 +2259,18 @@ map_refresh_info_sync (CamelFolder *folder,
 
 	/* Check for deleted messages */
 	if (initial_fetch) {
+		GList *gone = NULL;
+
 		uids = camel_folder_summary_get_array (folder->summary);
 		for (i = 0; i < uids->len; i++) {
 			if (!g_hash_table_lookup (all_msgs, uids->pdata[i])) {
 				camel_folder_summary_remove_uid (folder->summary, uids->pdata[i]);
 				camel_folder_change_info_remove_uid (ci, uids->pdata[i]);
+				gone = g_list_prepend (gone, uids->pdata[i]);
 			}
 		}
+		map_folder_forget_flags (map_folder, gone);
+		g_list_free (gone);
 		camel_folder_summary_free_array (uids);
 	}
 	
@@ -1053,27 +2282,128 @@ map_refresh_info_sync (CamelFolder *folder,
 //		camel_map_store_summary_set_folder_total (map_store->summary, id, total);
 //		camel_map_store_summary_set_folder_unread (map_store->summary, id, unread);
 //		camel_map_store_summary_save (map_store->summary, NULL);
-	if (camel_folder_change_info_changed (ci)) {
-		camel_folder_summary_touch (folder->summary);
-		camel_folder_summary_save_to_db (folder->summary, NULL);
+	CAMEL_MAP_SUMMARY (folder->summary)->listing_time = listing_time;
+	camel_folder_summary_touch (folder->summary);
+	map_folder_schedule_summary_save (map_folder);
+
+	if (camel_folder_change_info_changed (ci))
 		camel_folder_changed (folder, ci);
-	}
-	camel_folder_change_info_free (ci);
 
 	if (local_error)
 		g_propagate_error (error, local_error);
 
-	camel_map_store_folder_unlock (map_store);
+	/* The device is reachable, write out what was changed offline */
+	map_folder_schedule_flags_flush (map_folder);
+
+	if (ci->uid_added->len)
+		camel_map_store_queue_prefetch (map_store, folder, ci->uid_added);
+	camel_folder_change_info_free (ci);
 
 	
 	g_mutex_lock (priv->state_lock);
 	priv->refreshing = FALSE;
 	g_mutex_unlock (priv->state_lock);
-
+	g_object_unref (map);
 
 	return !local_error;
 }
 
+static gboolean
+map_folder_synchronize_message_sync (CamelFolder *folder,
+				     const gchar *uid,
+				     GCancellable *cancellable,
+				     GError **error)
+{
+	GPtrArray *uids, *statuses;
+	GError *local_error;
+	gboolean success;
+
+	/* Through the batch path, so that the conversion runs off the
+	 * transfer just as for downsync */
+	uids = g_ptr_array_new ();
+	g_ptr_array_add (uids, (gchar *) uid);
+	statuses = camel_map_folder_fetch_messages ((CamelMapFolder *) folder, uids, cancellable, error);
+	g_ptr_array_free (uids, TRUE);
+
+	if (!statuses)
+		return FALSE;
+
+	local_error = statuses->pdata[0];
+	success = local_error == NULL;
+	if (local_error)
+		g_propagate_error (error, g_error_copy (local_error));
+	g_ptr_array_unref (statuses);
+
+	return success;
+}
+
+static gboolean
+map_folder_downsync_sync (CamelOfflineFolder *offline_folder,
+			  const gchar *expression,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	CamelFolder *folder = (CamelFolder *) offline_folder;
+	CamelMapFolder *map_folder = (CamelMapFolder *) offline_folder;
+	GPtrArray *uids, *uncached_uids;
+	gboolean success = TRUE;
+	gint i;
+
+	camel_operation_push_message (
+		cancellable,
+		_("Syncing messages in folder '%s' to disk"),
+		camel_folder_get_display_name (folder));
+
+	if (expression)
+		uids = camel_folder_search_by_expression (folder, expression, cancellable, NULL);
+	else
+		uids = camel_folder_get_uids (folder);
+
+	if (!uids) {
+		camel_operation_pop_message (cancellable);
+		return TRUE;
+	}
+
+	uncached_uids = g_ptr_array_new ();
+	for (i = 0; i < uids->len; i++) {
+		if (!camel_map_folder_is_message_cached (map_folder, uids->pdata[i]))
+			g_ptr_array_add (uncached_uids, uids->pdata[i]);
+	}
+
+	/* Whole batches keep the session busy, the chunking is only
+	 * there so that progress gets reported */
+	for (i = 0; success && i < uncached_uids->len; i += MAP_DOWNSYNC_BATCH_SIZE) {
+		GPtrArray *batch, *statuses;
+		gint j;
+
+		batch = g_ptr_array_sized_new (MAP_DOWNSYNC_BATCH_SIZE);
+		for (j = i; j < uncached_uids->len && j < i + MAP_DOWNSYNC_BATCH_SIZE; j++)
+			g_ptr_array_add (batch, uncached_uids->pdata[j]);
+
+		statuses = camel_map_folder_fetch_messages (map_folder, batch, cancellable, error);
+		if (statuses)
+			g_ptr_array_unref (statuses);
+		else
+			success = FALSE;
+		g_ptr_array_free (batch, TRUE);
+
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			success = FALSE;
+
+		camel_operation_progress (cancellable, j * 100 / uncached_uids->len);
+	}
+
+	g_ptr_array_free (uncached_uids, TRUE);
+	if (expression)
+		camel_folder_search_free (folder, uids);
+	else
+		camel_folder_free_uids (folder, uids);
+
+	camel_operation_pop_message (cancellable);
+
+	return success;
+}
+
 static gboolean
 map_append_message_sync (CamelFolder *folder,
                          CamelMimeMessage *message,
@@ -1117,15 +2447,61 @@ map_expunge_sync (CamelFolder *folder,
 	return map_folder_delete_messages (folder, cancellable, error);
 }
 
+/* Uids are MAP handles, 64 bit numbers in hex, and have to be ordered
+ * as numbers: "9" comes before "10" */
 static gint
 map_cmp_uids (CamelFolder *folder,
               const gchar *uid1,
               const gchar *uid2)
 {
+	guint64 handle1, handle2;
+
 	g_return_val_if_fail (uid1 != NULL, 0);
 	g_return_val_if_fail (uid2 != NULL, 0);
 
-	return strcmp (uid1, uid2);
+	handle1 = camel_map_uid_to_handle (uid1);
+	handle2 = camel_map_uid_to_handle (uid2);
+
+	return handle1 < handle2 ? -1 : handle1 > handle2 ? 1 : 0;
+}
+
+typedef struct _MapSortItem {
+	guint64 handle;
+	gpointer uid;
+} MapSortItem;
+
+static gint
+map_sort_item_cmp (gconstpointer a,
+		   gconstpointer b)
+{
+	const MapSortItem *item1 = a, *item2 = b;
+
+	return item1->handle < item2->handle ? -1 : item1->handle > item2->handle ? 1 : 0;
+}
+
+/* Converts every uid once and sorts the numbers, rather than parsing
+ * both sides of each comparison */
+static void
+map_folder_sort_uids (CamelFolder *folder,
+		      GPtrArray *uids)
+{
+	MapSortItem *items;
+	guint i;
+
+	if (uids->len < 2)
+		return;
+
+	items = g_new (MapSortItem, uids->len);
+	for (i = 0; i < uids->len; i++) {
+		items[i].handle = camel_map_uid_to_handle (uids->pdata[i]);
+		items[i].uid = uids->pdata[i];
+	}
+
+	qsort (items, uids->len, sizeof (MapSortItem), map_sort_item_cmp);
+
+	for (i = 0; i < uids->len; i++)
+		uids->pdata[i] = items[i].uid;
+	g_free (items);
 }
 
 static void
@@ -1133,6 +2509,18 @@ map_folder_dispose (GObject *object)
 {
 	CamelMapFolder *map_folder = CAMEL_MAP_FOLDER (object);
 
+	/* Let running conversions finish before the cache goes away */
+	if (map_folder->priv->parse_pool != NULL) {
+		g_thread_pool_free (map_folder->priv->parse_pool, FALSE, TRUE);
+		map_folder->priv->parse_pool = NULL;
+	}
+
+	if (map_folder->priv->save_lock != NULL) {
+		camel_map_folder_save_summary (map_folder);
+		g_mutex_free (map_folder->priv->save_lock);
+		map_folder->priv->save_lock = NULL;
+	}
+
 	if (map_folder->cache != NULL) {
 		g_object_unref (map_folder->cache);
 		map_folder->cache = NULL;
@@ -1143,13 +2531,22 @@ map_folder_dispose (GObject *object)
 		map_folder->search = NULL;
 	}
 
-	g_object_unref (map_folder->priv->map);
 	g_free (map_folder->priv->map_dir);
 
 	g_mutex_free (map_folder->priv->search_lock);
 	g_hash_table_destroy (map_folder->priv->uid_eflags);
+
 	g_cond_free (map_folder->priv->fetch_cond);
 
+	g_hash_table_destroy (map_folder->priv->pending_flags);
+	g_mutex_free (map_folder->priv->flags_lock);
+	if (map_folder->priv->journal) {
+		if (map_folder->priv->journal_unsynced)
+			fsync (fileno (map_folder->priv->journal));
+		fclose (map_folder->priv->journal);
+	}
+	g_free (map_folder->priv->journal_file);
+
 //	if (CAMEL_FOLDER (map_folder)->summary)
 //		g_signal_handlers_disconnect_by_func (CAMEL_FOLDER (map_folder)->summary, G_CALLBACK (map_folder_count_notify_cb), map_folder);
 
@@ -1197,6 +2594,7 @@ camel_map_folder_class_init (CamelMapFolderClass *class)
 {
 	GObjectClass *object_class;
 	CamelFolderClass *folder_class;
+	CamelOfflineFolderClass *offline_folder_class;
 
 	g_type_class_add_private (class, sizeof (CamelMapFolderPrivate));
 
@@ -1210,6 +2608,7 @@ camel_map_folder_class_init (CamelMapFolderClass *class)
 	folder_class->search_by_expression = map_folder_search_by_expression;
 	folder_class->count_by_expression = map_folder_count_by_expression;
 	folder_class->cmp_uids = map_cmp_uids;
+	folder_class->sort_uids = map_folder_sort_uids;
 	folder_class->search_by_uids = map_folder_search_by_uids;
 	folder_class->search_free = map_folder_search_free;
 	folder_class->append_message_sync = map_append_message_sync;
@@ -1218,6 +2617,10 @@ camel_map_folder_class_init (CamelMapFolderClass *class)
 	folder_class->expunge_sync = map_expunge_sync;
 	folder_class->transfer_messages_to_sync = map_transfer_messages_to_sync;
 	folder_class->get_filename = map_get_filename;
+	folder_class->synchronize_message_sync = map_folder_synchronize_message_sync;
+
+	offline_folder_class = CAMEL_OFFLINE_FOLDER_CLASS (class);
+	offline_folder_class->downsync_sync = map_folder_downsync_sync;
 }
 
 static void
@@ -1241,48 +2644,387 @@ camel_map_folder_init (CamelMapFolder *map_folder)
 
 	map_folder->priv->fetch_cond = g_cond_new ();
 	map_folder->priv->uid_eflags = g_hash_table_new (g_str_hash, g_str_equal);
+
+	map_folder->priv->flags_lock = g_mutex_new ();
+	map_folder->priv->pending_flags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+	map_folder->priv->save_lock = g_mutex_new ();
+
+	map_folder->priv->parse_pool = g_thread_pool_new (
+		map_folder_parse_job, map_folder, MAP_PARSE_THREADS, FALSE, NULL);
 	camel_folder_set_lock_async (folder, TRUE);
 }
 
-void
-camel_map_folder_mark_message_read (CamelMapFolder *map_folder,
-				    const char *uid,
-				    gboolean read)
+/* The journal is a text file next to the summary with one
+ * "<uid> <mask> <value> <time>" line per change, appended as changes
+ * come in; later lines override earlier ones. It is rewritten with
+ * whatever is still pending after every flush and removed once nothing
+ * is. Appends are not synced one by one, a flag change has to stay
+ * cheap for the caller; map_folder_journal_sync() syncs them in one go
+ * from the background summary save, the flush, and on close.
+ * Expects the flags lock to be held. */
+static void
+map_folder_journal_append (CamelMapFolder *map_folder,
+			   const gchar *uid,
+			   const MapFlagIntent *intent)
 {
-	CamelMapFolderPrivate *priv;
+	CamelMapFolderPrivate *priv = map_folder->priv;
+
+	if (!priv->journal)
+		priv->journal = g_fopen (priv->journal_file, "a");
+	if (!priv->journal) {
+		printf("Unable to open %s: %s\n", priv->journal_file, g_strerror (errno));
+		return;
+	}
+
+	fprintf (priv->journal, "%s %u %u %" G_GINT64_FORMAT "\n", uid, intent->mask, intent->value, intent->time);
+	if (fflush (priv->journal) != 0)
+		printf("Unable to write %s: %s\n", priv->journal_file, g_strerror (errno));
+	priv->journal_unsynced = TRUE;
+}
+
+/* Gets the appends since the last call onto the disk */
+static void
+map_folder_journal_sync (CamelMapFolder *map_folder)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+
+	g_mutex_lock (priv->flags_lock);
+	if (priv->journal && priv->journal_unsynced) {
+		if (fsync (fileno (priv->journal)) != 0)
+			printf("Unable to sync %s: %s\n", priv->journal_file, g_strerror (errno));
+		priv->journal_unsynced = FALSE;
+	}
+	g_mutex_unlock (priv->flags_lock);
+}
+
+/* Expects the flags lock to be held */
+static void
+map_folder_journal_rewrite (CamelMapFolder *map_folder)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	GHashTableIter iter;
+	gpointer key, value;
+	GString *contents;
+
+	if (priv->journal) {
+		fclose (priv->journal);
+		priv->journal = NULL;
+	}
+	/* The file is replaced, which syncs it */
+	priv->journal_unsynced = FALSE;
+
+	if (!g_hash_table_size (priv->pending_flags)) {
+		g_unlink (priv->journal_file);
+		return;
+	}
+
+	contents = g_string_new ("");
+	g_hash_table_iter_init (&iter, priv->pending_flags);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		MapFlagIntent *intent = value;
+
+		g_string_append_printf (
+			contents, "%s %u %u %" G_GINT64_FORMAT "\n",
+			(gchar *) key, intent->mask, intent->value, intent->time);
+	}
+	/* Replaced by rename, after syncing when there was a journal */
+	g_file_set_contents (priv->journal_file, contents->str, contents->len, NULL);
+	g_string_free (contents, TRUE);
+}
+
+/* Picks up the changes made while offline in an earlier session */
+static void
+map_folder_journal_load (CamelMapFolder *map_folder,
+			 const gchar *folder_dir)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	gchar *contents, **lines;
+	gint i;
+
+	priv->journal_file = g_build_filename (folder_dir, "flags-journal", NULL);
+	if (!g_file_get_contents (priv->journal_file, &contents, NULL, NULL))
+		return;
+
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	g_mutex_lock (priv->flags_lock);
+	for (i = 0; lines[i]; i++) {
+		gchar **fields = g_strsplit (lines[i], " ", 4);
+		guint n_fields = g_strv_length (fields);
+
+		/* Journals from before times were kept have no time */
+		if (n_fields == 3 || n_fields == 4) {
+			MapFlagIntent *intent;
+			guint32 mask, value;
+			gint64 time = 0;
+
+			mask = (guint32) g_ascii_strtoull (fields[1], NULL, 10) & (CAMEL_MESSAGE_SEEN | CAMEL_MESSAGE_DELETED);
+			value = (guint32) g_ascii_strtoull (fields[2], NULL, 10);
+			if (n_fields == 4)
+				time = g_ascii_strtoll (fields[3], NULL, 10);
+
+			intent = g_hash_table_lookup (priv->pending_flags, fields[0]);
+			if (!intent) {
+				intent = g_new0 (MapFlagIntent, 1);
+				g_hash_table_insert (priv->pending_flags, g_strdup (fields[0]), intent);
+			}
+			intent->mask |= mask;
+			intent->value = (intent->value & ~mask) | (value & mask);
+			intent->time = MAX (intent->time, time);
+		}
+		g_strfreev (fields);
+	}
+	g_mutex_unlock (priv->flags_lock);
+
+	g_strfreev (lines);
+}
+
+/* Returns the flags with a change pending for uid, their values in
+ * value and when they were changed in time */
+static guint32
+map_folder_get_pending_flags (CamelMapFolder *map_folder,
+			      const gchar *uid,
+			      guint32 *value,
+			      gint64 *time)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	MapFlagIntent *intent;
+	guint32 mask = 0;
+
+	g_mutex_lock (priv->flags_lock);
+	intent = g_hash_table_lookup (priv->pending_flags, uid);
+	if (intent) {
+		mask = intent->mask;
+		*value = intent->value;
+		*time = intent->time;
+	}
+	g_mutex_unlock (priv->flags_lock);
+
+	return mask;
+}
+
+/* For messages that are gone from the device; the journal is
+ * rewritten once for all of them */
+static void
+map_folder_forget_flags (CamelMapFolder *map_folder,
+			 GList *uids)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	gboolean removed = FALSE;
+	GList *link;
+
+	g_mutex_lock (priv->flags_lock);
+	for (link = uids; link; link = link->next)
+		if (g_hash_table_remove (priv->pending_flags, link->data))
+			removed = TRUE;
+	if (removed)
+		map_folder_journal_rewrite (map_folder);
+	g_mutex_unlock (priv->flags_lock);
+}
+
+/* Offline nothing is queued, the journal keeps the changes until the
+ * next refresh. Expects the flags lock to be held. */
+static void
+map_folder_queue_flags_flush (CamelMapFolder *map_folder)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
 	CamelMapStore *map_store;
-	gboolean res;
-	GError *local_error = NULL;
-	gchar *msg_id;
-	
-	map_store = (CamelMapStore *) camel_folder_get_parent_store ((CamelFolder *)map_folder);
+	GDBusProxy *map;
 
-	priv = map_folder->priv;
+	if (priv->flags_flush_queued || !g_hash_table_size (priv->pending_flags))
+		return;
 
+	map_store = (CamelMapStore *) camel_folder_get_parent_store ((CamelFolder *) map_folder);
+	map = camel_map_store_ref_map_proxy (map_store);
+	if (!map)
+		return;
+	g_object_unref (map);
 
-	camel_map_store_folder_lock (map_store);
-	
-	msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
-	
-	if (!camel_map_store_set_current_folder (map_store, map_folder->priv->map_dir, NULL, &local_error)) {
-		goto exit;
+	priv->flags_flush_queued = TRUE;
+	camel_map_store_queue_operation (
+		map_store, CAMEL_MAP_OPERATION_FLAGS, priv->map_dir,
+		map_folder_flush_flags_cb, g_object_ref (map_folder), g_object_unref);
+}
+
+/* Replays the journal once the device is reachable again */
+static void
+map_folder_schedule_flags_flush (CamelMapFolder *map_folder)
+{
+	g_mutex_lock (map_folder->priv->flags_lock);
+	map_folder_queue_flags_flush (map_folder);
+	g_mutex_unlock (map_folder->priv->flags_lock);
+}
+
+/* What was written is now also the device's state */
+static void
+map_folder_set_server_flags (CamelMapFolder *map_folder,
+			     const gchar *uid,
+			     guint32 mask,
+			     guint32 value)
+{
+	CamelFolder *folder = (CamelFolder *) map_folder;
+	CamelMapMessageInfo *info;
+
+	if (!mask)
+		return;
+
+	info = (CamelMapMessageInfo *) camel_folder_summary_get (folder->summary, uid);
+	if (info) {
+		info->server_flags = (info->server_flags & ~mask) | (value & mask);
+		camel_folder_summary_touch (folder->summary);
+		camel_message_info_free (info);
+
+		map_folder_schedule_summary_save (map_folder);
 	}
-	printf("Objid: %s\n", msg_id);
-	
-	res = camel_map_dbus_set_message_read (map_folder->priv->map,
-					       msg_id,
-					       read,
-					       NULL,
-					       &local_error);
+}
 
-	if (local_error) {
-		goto exit;
+/* Puts back intents a flush could not write, unless a newer change for
+ * the same message came in meanwhile. Takes over intents. */
+static void
+map_folder_restore_flags (CamelMapFolder *map_folder,
+			  GHashTable *intents)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_mutex_lock (priv->flags_lock);
+	g_hash_table_iter_init (&iter, intents);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		if (!g_hash_table_lookup (priv->pending_flags, key)) {
+			g_hash_table_iter_steal (&iter);
+			g_hash_table_insert (priv->pending_flags, key, value);
+		}
 	}
+	map_folder_journal_rewrite (map_folder);
+	g_mutex_unlock (priv->flags_lock);
 
-exit:
-	camel_map_store_folder_unlock (map_store);	
+	g_hash_table_destroy (intents);
+}
+
+/* Writes out all pending flag changes with a single SetFolder. Expects
+ * the cursor to be locked; runs from the store's operation queue. */
+static gboolean
+map_folder_flush_flags_cb (CamelMapStore *map_store,
+			   gpointer user_data,
+			   GCancellable *cancellable,
+			   GError **error)
+{
+	CamelMapFolder *map_folder = user_data;
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	GHashTable *intents;
+	GHashTableIter iter;
+	gpointer key, value;
+	GDBusProxy *map;
+	gboolean success = TRUE;
+
+	/* What is about to be written should survive a crash meanwhile */
+	map_folder_journal_sync (map_folder);
 
-	return;	
+	g_mutex_lock (priv->flags_lock);
+	intents = priv->pending_flags;
+	priv->pending_flags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	priv->flags_flush_queued = FALSE;
+	g_mutex_unlock (priv->flags_lock);
+
+	if (!g_hash_table_size (intents)) {
+		g_hash_table_destroy (intents);
+		return TRUE;
+	}
+
+	map = map_folder_ref_proxy (map_folder, error);
+	if (!map) {
+		map_folder_restore_flags (map_folder, intents);
+		return FALSE;
+	}
+
+	if (!camel_map_store_set_current_folder (map_store, priv->map_dir, cancellable, error)) {
+		map_folder_restore_flags (map_folder, intents);
+		g_object_unref (map);
+		return FALSE;
+	}
+
+	g_hash_table_iter_init (&iter, intents);
+	while (success && g_hash_table_iter_next (&iter, &key, &value)) {
+		const gchar *uid = key;
+		MapFlagIntent *intent = value;
+		GError *local_error = NULL;
+		gchar *msg_id;
+
+		msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
+		printf("Objid: %s\n", msg_id);
+
+		if ((intent->mask & CAMEL_MESSAGE_SEEN) != 0)
+			camel_map_dbus_set_message_read (map, msg_id, (intent->value & CAMEL_MESSAGE_SEEN) != 0, cancellable, &local_error);
+		if (!local_error && (intent->mask & CAMEL_MESSAGE_DELETED) != 0)
+			camel_map_dbus_set_message_deleted (map, msg_id, (intent->value & CAMEL_MESSAGE_DELETED) != 0, cancellable, &local_error);
+		g_free (msg_id);
+
+		if (!local_error) {
+			map_folder_set_server_flags (map_folder, uid, intent->mask & CAMEL_MESSAGE_SEEN, intent->value);
+			g_hash_table_iter_remove (&iter);
+		} else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+			   g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN) ||
+			   g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_NO_REPLY)) {
+			/* The session is gone, keep the rest for later */
+			g_propagate_error (error, local_error);
+			success = FALSE;
+		} else {
+			/* Most likely the message is gone from the device */
+			d (g_debug ("Could not update flags of %s: %s", uid, local_error->message));
+			g_hash_table_iter_remove (&iter);
+			g_clear_error (&local_error);
+		}
+	}
+
+	map_folder_restore_flags (map_folder, intents);
+	g_object_unref (map);
+
+	return success;
+}
+
+/* Records a flag change for the device. Changes are applied to the
+ * summary right away by the caller; the device is updated in batches
+ * from the store's operation queue, and changing the same flag twice
+ * before that only writes the last value. */
+static void
+map_folder_queue_flag_write (CamelMapFolder *map_folder,
+			     const gchar *uid,
+			     guint32 flag,
+			     gboolean set)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	MapFlagIntent *intent;
+
+	g_mutex_lock (priv->flags_lock);
+
+	intent = g_hash_table_lookup (priv->pending_flags, uid);
+	if (!intent) {
+		intent = g_new0 (MapFlagIntent, 1);
+		g_hash_table_insert (priv->pending_flags, g_strdup (uid), intent);
+	}
+	intent->mask |= flag;
+	intent->value = (intent->value & ~flag) | (set ? flag : 0);
+	intent->time = g_get_real_time () / G_USEC_PER_SEC;
+	map_folder_journal_append (map_folder, uid, intent);
+
+	map_folder_queue_flags_flush (map_folder);
+
+	g_mutex_unlock (priv->flags_lock);
+
+	/* Also syncs the journal, off this thread */
+	map_folder_schedule_summary_save (map_folder);
+}
+
+/* Flag changes are written to the device in the background */
+void
+camel_map_folder_mark_message_read (CamelMapFolder *map_folder,
+				    const char *uid,
+				    gboolean read)
+{
+	map_folder_queue_flag_write (map_folder, uid, CAMEL_MESSAGE_SEEN, read);
 }
 
 void
@@ -1290,40 +3032,172 @@ camel_map_folder_mark_message_deleted (CamelMapFolder *map_folder,
 				       const char *uid,
 				       gboolean deleted)
 {
-	CamelMapFolderPrivate *priv;
-	CamelMapStore *map_store;
-	gboolean res;
+	map_folder_queue_flag_write (map_folder, uid, CAMEL_MESSAGE_DELETED, deleted);
+}
 
-	GError *local_error = NULL;
-	gchar *msg_id;
-	
-	map_store = (CamelMapStore *) camel_folder_get_parent_store ((CamelFolder *)map_folder);
+/* For a flag that was changed back to what the device has, so there
+ * is nothing left to write */
+void
+camel_map_folder_discard_flag_change (CamelMapFolder *map_folder,
+				      const char *uid,
+				      guint32 flag)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	MapFlagIntent *intent;
+
+	g_mutex_lock (priv->flags_lock);
+	intent = g_hash_table_lookup (priv->pending_flags, uid);
+	if (intent && (intent->mask & flag) != 0) {
+		intent->mask &= ~flag;
+		if (!intent->mask)
+			g_hash_table_remove (priv->pending_flags, uid);
+		map_folder_journal_rewrite (map_folder);
+	}
+	g_mutex_unlock (priv->flags_lock);
+}
 
-	priv = map_folder->priv;
+/* Whether the full message, attachments included, is cached */
+gboolean
+camel_map_folder_is_message_cached (CamelMapFolder *map_folder,
+				    const gchar *uid)
+{
+	return map_folder_has_cached_variant (map_folder, MAP_CACHE_FULL, uid);
+}
 
+/* Whether only the preview without attachments is cached */
+gboolean
+camel_map_folder_is_message_partial (CamelMapFolder *map_folder,
+				     const gchar *uid)
+{
+	return !map_folder_has_cached_variant (map_folder, MAP_CACHE_FULL, uid) &&
+		map_folder_has_cached_variant (map_folder, MAP_CACHE_PARTIAL, uid);
+}
 
-	camel_map_store_folder_lock (map_store);
-	
-	msg_id = g_strdup_printf("%s/message%s", camel_map_store_get_map_session_path(map_store), uid);
-	
-	if (!camel_map_store_set_current_folder (map_store, map_folder->priv->map_dir, NULL, &local_error)) {
-		goto exit;
-	}
-	printf("Objid: %s\n", msg_id);
-	
-	res = camel_map_dbus_set_message_deleted (map_folder->priv->map,
-						  msg_id,
-						  deleted,
-						  NULL,
-						  &local_error);
+/* Returns the message with its attachments, downloading it in full if
+ * only the preview was fetched so far. Meant for opening or saving
+ * attachments; get_message() keeps serving the preview. */
+CamelMimeMessage *
+camel_map_folder_get_full_message (CamelMapFolder *map_folder,
+				   const gchar *uid,
+				   GCancellable *cancellable,
+				   GError **error)
+{
+	CamelMapStore *map_store;
+	CamelMimeMessage *message;
 
-	if (local_error) {
-		goto exit;
+	message = map_folder_get_message_from_cache_path (map_folder, MAP_CACHE_FULL, uid, cancellable, NULL);
+	if (!message) {
+		map_store = (CamelMapStore *) camel_folder_get_parent_store ((CamelFolder *) map_folder);
+
+		camel_map_store_begin_foreground_fetch (map_store);
+		message = camel_map_folder_get_message ((CamelFolder *) map_folder, uid, TRUE, cancellable, error);
+		camel_map_store_end_foreground_fetch (map_store);
 	}
 
-exit:
-	camel_map_store_folder_unlock (map_store);	
+	return message;
+}
+
+/* Downloads the message into the cache without parsing it, used to
+ * fill the cache in the background. */
+gboolean
+camel_map_folder_fetch_message (CamelMapFolder *map_folder,
+				const gchar *uid,
+				GCancellable *cancellable,
+				GError **error)
+{
+	if (camel_map_folder_is_message_cached (map_folder, uid))
+		return TRUE;
 
-	return;	
+	return map_folder_download_message ((CamelFolder *) map_folder, uid, TRUE, CAMEL_MAP_OPERATION_PREFETCH, cancellable, error);
 }
 /** End **/
+
+static void
+map_folder_save_summary_job (CamelSession *session,
+			     GCancellable *cancellable,
+			     CamelMapFolder *map_folder,
+			     GError **error)
+{
+	camel_map_folder_save_summary (map_folder);
+}
+
+static gboolean
+map_folder_save_summary_timeout_cb (gpointer user_data)
+{
+	CamelMapFolder *map_folder = user_data;
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	CamelStore *parent_store;
+
+	/* A newer change may have rescheduled us meanwhile */
+	g_mutex_lock (priv->save_lock);
+	if (priv->save_source == g_source_get_id (g_main_current_source ()))
+		priv->save_source = 0;
+	g_mutex_unlock (priv->save_lock);
+
+	/* Keep SQLite off the main loop */
+	parent_store = camel_folder_get_parent_store ((CamelFolder *) map_folder);
+	camel_session_submit_job (
+		camel_service_get_session (CAMEL_SERVICE (parent_store)),
+		(CamelSessionCallback) map_folder_save_summary_job,
+		g_object_ref (map_folder),
+		(GDestroyNotify) g_object_unref);
+
+	return FALSE;
+}
+
+/* Call after touching the summary instead of saving it right away.
+ * Every call pushes the save back by MAP_SUMMARY_SAVE_DELAY, so a burst
+ * of refreshes ends in a single save, which happens no later than
+ * MAP_SUMMARY_SAVE_MAX_LATENCY after the first of them. */
+static void
+map_folder_schedule_summary_save (CamelMapFolder *map_folder)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	gint64 now, delay;
+
+	now = g_get_monotonic_time ();
+
+	g_mutex_lock (priv->save_lock);
+	if (!priv->save_deadline)
+		priv->save_deadline = now + MAP_SUMMARY_SAVE_MAX_LATENCY * G_TIME_SPAN_SECOND;
+
+	if (priv->save_source)
+		g_source_remove (priv->save_source);
+
+	delay = MIN (MAP_SUMMARY_SAVE_DELAY * G_TIME_SPAN_SECOND, priv->save_deadline - now);
+	priv->save_source = g_timeout_add_full (
+		G_PRIORITY_DEFAULT, MAX (delay, 0) / G_TIME_SPAN_MILLISECOND,
+		map_folder_save_summary_timeout_cb,
+		g_object_ref (map_folder), g_object_unref);
+	g_mutex_unlock (priv->save_lock);
+}
+
+/**
+ * camel_map_folder_save_summary:
+ * @map_folder: a #CamelMapFolder
+ *
+ * Writes a summary save scheduled by a refresh, an expunge or a flag
+ * update out right away, instead of waiting for it to settle, and syncs
+ * the flag journal.
+ **/
+void
+camel_map_folder_save_summary (CamelMapFolder *map_folder)
+{
+	CamelMapFolderPrivate *priv = map_folder->priv;
+	CamelFolder *folder = (CamelFolder *) map_folder;
+	gboolean dirty;
+
+	g_mutex_lock (priv->save_lock);
+	if (priv->save_source) {
+		g_source_remove (priv->save_source);
+		priv->save_source = 0;
+	}
+	dirty = priv->save_deadline != 0;
+	priv->save_deadline = 0;
+	g_mutex_unlock (priv->save_lock);
+
+	if (dirty && folder->summary)
+		camel_folder_summary_save_to_db (folder->summary, NULL);
+
+	map_folder_journal_sync (map_folder);
+}
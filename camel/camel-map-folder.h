@@ -71,10 +71,9 @@ GType camel_map_folder_get_type (void);
 
 /* implemented */
 CamelFolder * 			camel_map_folder_new 	(CamelStore *store,
-							 GDBusProxy *map,
 							 const gchar *map_dir,
-							 const gchar *folder_dir,
 							 const gchar *folder_name,
+							 const gchar *folder_dir,
 							 GCancellable *cancellable,
 							 GError **error);
 void				camel_map_folder_mark_message_read 
@@ -85,6 +84,33 @@ void				camel_map_folder_mark_message_deleted
 							(CamelMapFolder *map_folder,
 							 const char *uid,
 							 gboolean read);
+void				camel_map_folder_discard_flag_change
+							(CamelMapFolder *map_folder,
+							 const char *uid,
+							 guint32 flag);
+gboolean			camel_map_folder_is_message_cached
+							(CamelMapFolder *map_folder,
+							 const gchar *uid);
+gboolean			camel_map_folder_is_message_partial
+							(CamelMapFolder *map_folder,
+							 const gchar *uid);
+CamelMimeMessage *		camel_map_folder_get_full_message
+							(CamelMapFolder *map_folder,
+							 const gchar *uid,
+							 GCancellable *cancellable,
+							 GError **error);
+gboolean			camel_map_folder_fetch_message
+							(CamelMapFolder *map_folder,
+							 const gchar *uid,
+							 GCancellable *cancellable,
+							 GError **error);
+GPtrArray *			camel_map_folder_fetch_messages
+							(CamelMapFolder *map_folder,
+							 GPtrArray *uids,
+							 GCancellable *cancellable,
+							 GError **error);
+void				camel_map_folder_save_summary
+							(CamelMapFolder *map_folder);
 
 
 G_END_DECLS
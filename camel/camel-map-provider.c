@@ -49,6 +49,8 @@ CamelProviderConfEntry map_conf_entries[] = {
 	  N_("_Apply filters to new messages in Inbox on this server"), "1" },
 	{ CAMEL_PROVIDER_CONF_CHECKBOX, "stay-synchronized", NULL,
 	  N_("Automatically synchroni_ze remote mail locally"), "0" },
+	{ CAMEL_PROVIDER_CONF_CHECKBOX, "force-set-folder", NULL,
+	  N_("Always re-send SetFolder (needed by some phones)"), "0" },
 	{ CAMEL_PROVIDER_CONF_SECTION_END },
 	{ CAMEL_PROVIDER_CONF_END }
 };
@@ -0,0 +1,61 @@
+/* Measures how many SMS a second are written out as the MIME messages
+ * the cache holds, the way a downloaded SMS is converted.
+ *
+ *   camel-map-sms-bench [count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <camel/camel.h>
+
+#include "camel-map-sms.h"
+
+#define DEFAULT_COUNT 100000
+
+static const gchar sms_text[] =
+	"Running late, the train is stuck outside the station.\r\n"
+	"From what they say it will be another 20 minutes.\r\n";
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+	guint count = DEFAULT_COUNT, i;
+	GError *error = NULL;
+	gsize bytes = 0;
+	gint64 start, elapsed;
+	gchar message_id[64];
+
+	g_type_init ();
+	camel_init (g_get_tmp_dir (), FALSE);
+
+	if (argc > 1)
+		count = strtoul (argv[1], NULL, 10);
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < count; i++) {
+		CamelStream *sink, *stream;
+
+		sink = camel_stream_mem_new ();
+		g_snprintf (message_id, sizeof (message_id), "camel-bench-%u", i);
+		stream = camel_map_sms_begin (
+			sink, "Alice <+15550100>", NULL, 1347558666 + i,
+			message_id, "UTF-8", &error);
+		if (!stream ||
+		    camel_stream_write (stream, sms_text, sizeof (sms_text) - 1, NULL, &error) < 0 ||
+		    camel_stream_flush (stream, NULL, &error) == -1) {
+			printf("Conversion failed: %s\n", error ? error->message : "unknown error");
+			return 1;
+		}
+		bytes += camel_stream_mem_get_byte_array (CAMEL_STREAM_MEM (sink))->len;
+
+		g_object_unref (stream);
+		g_object_unref (sink);
+	}
+	elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+	printf("%u conversions in %.1f ms: %.0f/s, %" G_GSIZE_FORMAT " bytes each\n",
+	       count, elapsed / 1000.0, count * (gdouble) G_USEC_PER_SEC / elapsed,
+	       bytes / MAX (count, 1));
+
+	return 0;
+}
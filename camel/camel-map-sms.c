@@ -0,0 +1,132 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* camel-map-sms.c: writes an SMS out as a MIME message */
+
+/*
+ * Copyright (C) 2012 Intel Corporation. (www.intel.com)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU Lesser General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+
+#include <glib/gi18n-lib.h>
+
+#include "camel-map-sms.h"
+
+static const gchar *map_sms_days[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+static const gchar *map_sms_months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/**
+ * camel_map_sms_begin:
+ * @sink: where the message goes
+ * @from: the sender as an encoded address list, or %NULL
+ * @subject: the subject, or %NULL
+ * @date: when the SMS was sent
+ * @message_id: the Message-Id, without the angle brackets
+ * @charset: the bMessage CHARSET, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes the mbox From line and the headers of the message an SMS
+ * becomes to @sink, without building a #CamelMimeMessage. The text of
+ * the SMS then goes through the returned stream, whose From filter
+ * escapes lines that would look like the From line; flush it when done.
+ *
+ * Returns: a new stream on top of @sink, or %NULL on error
+ **/
+CamelStream *
+camel_map_sms_begin (CamelStream *sink,
+		     const gchar *from,
+		     const gchar *subject,
+		     time_t date,
+		     const gchar *message_id,
+		     const gchar *charset,
+		     GError **error)
+{
+	CamelInternetAddress *addr;
+	CamelMimeFilter *filter;
+	CamelStream *stream;
+	const gchar *email = NULL;
+	GError *local_error = NULL;
+	GString *out;
+	struct tm tm;
+	gchar *str;
+
+	addr = camel_internet_address_new ();
+	if (from)
+		camel_address_decode (CAMEL_ADDRESS (addr), from);
+	camel_internet_address_get (addr, 0, NULL, &email);
+
+	gmtime_r (&date, &tm);
+	out = g_string_new (NULL);
+	g_string_append_printf (
+		out, "From %s %s %s %2d %02d:%02d:%02d %4d\n",
+		email ? email : "unknown@nodomain",
+		map_sms_days[tm.tm_wday], map_sms_months[tm.tm_mon],
+		tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		tm.tm_year + 1900);
+
+	if (email) {
+		str = camel_address_encode (CAMEL_ADDRESS (addr));
+		g_string_append_printf (out, "From: %s\n", str);
+		g_free (str);
+	}
+	if (subject) {
+		str = camel_header_encode_string ((const guchar *) subject);
+		g_string_append_printf (out, "Subject: %s\n", str);
+		g_free (str);
+	}
+	str = camel_header_format_date (date, 0);
+	g_string_append_printf (out, "Date: %s\n", str);
+	g_free (str);
+	g_string_append_printf (out, "Message-Id: <%s>\n", message_id);
+	g_string_append (out, "MIME-Version: 1.0\n");
+
+	/* "native" means PDU encoded, which we don't decode */
+	if (charset && g_ascii_strcasecmp (charset, "native") != 0)
+		g_string_append_printf (out, "Content-Type: text/plain; charset=%s\n", charset);
+	else
+		g_string_append (out, "Content-Type: text/plain\n");
+	g_string_append (out, "Content-Transfer-Encoding: 8bit\n\n");
+
+	g_object_unref (addr);
+
+	if (camel_stream_write (sink, out->str, out->len, NULL, &local_error) < 0) {
+		if (!local_error)
+			g_set_error (
+				&local_error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+				_("Unable to write message to the cache"));
+		g_propagate_error (error, local_error);
+		g_string_free (out, TRUE);
+		return NULL;
+	}
+	g_string_free (out, TRUE);
+
+	filter = camel_mime_filter_from_new ();
+	stream = camel_stream_filter_new (sink);
+	camel_stream_filter_add (CAMEL_STREAM_FILTER (stream), filter);
+	g_object_unref (filter);
+
+	return stream;
+}
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/* camel-map-sms.h: writes an SMS out as a MIME message */
+
+/*
+ * Copyright (C) 2012 Intel Corporation. (www.intel.com)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU Lesser General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef CAMEL_MAP_SMS_H
+#define CAMEL_MAP_SMS_H
+
+#include <camel/camel.h>
+
+G_BEGIN_DECLS
+
+CamelStream *	camel_map_sms_begin		(CamelStream *sink,
+						 const gchar *from,
+						 const gchar *subject,
+						 time_t date,
+						 const gchar *message_id,
+						 const gchar *charset,
+						 GError **error);
+
+G_END_DECLS
+
+#endif /* CAMEL_MAP_SMS_H */
@@ -1,24 +1,66 @@
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <glib/gi18n-lib.h>
 #include <gio/gio.h>
 #include <string.h>
+#include <sqlite3.h>
 #include "camel-map-store-summary.h"
 
 #define S_LOCK(x) (g_static_rec_mutex_lock(&(x)->priv->s_lock))
 #define S_UNLOCK(x) (g_static_rec_mutex_unlock(&(x)->priv->s_lock))
 
-#define STORE_GROUP_NAME "##storepriv"
-#define CURRENT_SUMMARY_VERSION 1
+#define CURRENT_SUMMARY_VERSION 2
+
+/* The GKeyFile the folder tree was kept in before, next to the database */
+#define LEGACY_SUMMARY_FILE "folder-tree"
+#define LEGACY_GROUP_NAME "##storepriv"
+#define LEGACY_SUMMARY_VERSION 1
+
+/* One row per folder. full_name is derived from the parent chain and
+ * type from flags; both are stored so they can be looked up through an
+ * index. Values private to the store live in their own table. */
+#define SUMMARY_SCHEMA \
+	"CREATE TABLE IF NOT EXISTS folders (" \
+	" folder_id TEXT PRIMARY KEY," \
+	" parent_id TEXT," \
+	" full_name TEXT," \
+	" display_name TEXT," \
+	" change_key TEXT," \
+	" sync_state TEXT," \
+	" flags INTEGER NOT NULL DEFAULT 0," \
+	" type INTEGER NOT NULL DEFAULT 0," \
+	" unread INTEGER NOT NULL DEFAULT 0," \
+	" total INTEGER NOT NULL DEFAULT 0);" \
+	"CREATE INDEX IF NOT EXISTS folders_full_name ON folders (full_name);" \
+	"CREATE INDEX IF NOT EXISTS folders_type ON folders (type);" \
+	"CREATE TABLE IF NOT EXISTS store (" \
+	" key TEXT PRIMARY KEY," \
+	" value TEXT);"
+
+/* A node of the full name trie, one per path component. Nodes exist
+ * for every folder and for the names leading to it. */
+typedef struct _MapSsNode MapSsNode;
+struct _MapSsNode {
+	gchar *name;
+	const gchar *folder_id;	/* shared with fname_id_hash, NULL if no folder has this name */
+	MapSsNode *parent;
+	GHashTable *children;	/* name -> MapSsNode, NULL while there are none */
+};
 
 struct _CamelMapStoreSummaryPrivate {
-	GKeyFile *key_file;
-	gboolean dirty;
+	sqlite3 *db;
+	GHashTable *stmts;	/* SQL string -> prepared sqlite3_stmt */
+	gboolean dirty;		/* a write transaction is open */
 	gchar *path;
 	/* Note: We use the *same* strings in both of these hash tables, and
 	 * only id_fname_hash has g_free() hooked up as the destructor func.
 	 * So entries must always be removed from fname_id_hash *first*. */
 	GHashTable *id_fname_hash;
 	GHashTable *fname_id_hash;
+	/* Mirrors fname_id_hash, for finding the folders below a name */
+	MapSsNode *fname_trie;
+	/* type -> GSList of the ids of system folders of that type */
+	GHashTable *type_index;
 	GStaticRecMutex s_lock;
 
 	GFileMonitor *monitor_delete;
@@ -26,16 +68,206 @@ struct _CamelMapStoreSummaryPrivate {
 
 G_DEFINE_TYPE (CamelMapStoreSummary, camel_map_store_summary, CAMEL_TYPE_OBJECT)
 
+static MapSsNode *
+map_ss_node_new (const gchar *name,
+                 MapSsNode *parent)
+{
+	MapSsNode *node = g_slice_new0 (MapSsNode);
+
+	node->name = g_strdup (name);
+	node->parent = parent;
+
+	return node;
+}
+
+static void
+map_ss_node_free (MapSsNode *node)
+{
+	if (node->children)
+		g_hash_table_destroy (node->children);
+	g_free (node->name);
+	g_slice_free (MapSsNode, node);
+}
+
+/* Walks @full_name one component at a time, adding the missing nodes
+ * if @create is set */
+static MapSsNode *
+map_ss_trie_lookup (MapSsNode *root,
+                    const gchar *full_name,
+                    gboolean create)
+{
+	MapSsNode *node = root;
+	gchar **parts;
+	gint i;
+
+	parts = g_strsplit (full_name, "/", -1);
+	for (i = 0; node && parts[i]; i++) {
+		MapSsNode *child = NULL;
+
+		if (node->children)
+			child = g_hash_table_lookup (node->children, parts[i]);
+
+		if (!child && create) {
+			if (!node->children)
+				node->children = g_hash_table_new_full (
+					g_str_hash, g_str_equal, NULL,
+					(GDestroyNotify) map_ss_node_free);
+			child = map_ss_node_new (parts[i], node);
+			g_hash_table_insert (node->children, child->name, child);
+		}
+
+		node = child;
+	}
+	g_strfreev (parts);
+
+	return node;
+}
+
+static void
+map_ss_trie_insert (CamelMapStoreSummary *map_summary,
+                    const gchar *full_name,
+                    const gchar *folder_id)
+{
+	MapSsNode *node;
+
+	node = map_ss_trie_lookup (map_summary->priv->fname_trie, full_name, TRUE);
+	node->folder_id = folder_id;
+}
+
+/* Drops the name and whatever part of its path leads nowhere else */
+static void
+map_ss_trie_remove (CamelMapStoreSummary *map_summary,
+                    const gchar *full_name)
+{
+	MapSsNode *node;
+
+	node = map_ss_trie_lookup (map_summary->priv->fname_trie, full_name, FALSE);
+	if (!node)
+		return;
+
+	node->folder_id = NULL;
+	while (node->parent && !node->folder_id &&
+	       (!node->children || !g_hash_table_size (node->children))) {
+		MapSsNode *parent = node->parent;
+
+		g_hash_table_remove (parent->children, node->name);
+		node = parent;
+	}
+}
+
+/* Prepends copies of the ids of all folders below @node */
+static void
+map_ss_trie_collect (MapSsNode *node,
+                     GSList **ids)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!node || !node->children)
+		return;
+
+	g_hash_table_iter_init (&iter, node->children);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		MapSsNode *child = value;
+
+		if (child->folder_id)
+			*ids = g_slist_prepend (*ids, g_strdup (child->folder_id));
+		map_ss_trie_collect (child, ids);
+	}
+}
+
+/* Only system folders can be looked up by type */
+static void
+map_ss_type_index_add (CamelMapStoreSummary *map_summary,
+                       const gchar *folder_id,
+                       guint64 flags)
+{
+	GHashTable *type_index = map_summary->priv->type_index;
+	gpointer type = GUINT_TO_POINTER ((guint) (flags & CAMEL_FOLDER_TYPE_MASK));
+	GSList *ids;
+
+	if (!type || !(flags & CAMEL_FOLDER_SYSTEM))
+		return;
+
+	ids = g_hash_table_lookup (type_index, type);
+	if (g_slist_find_custom (ids, folder_id, (GCompareFunc) strcmp))
+		return;
+
+	g_hash_table_steal (type_index, type);
+	g_hash_table_insert (type_index, type, g_slist_append (ids, g_strdup (folder_id)));
+}
+
+static void
+map_ss_type_index_remove (CamelMapStoreSummary *map_summary,
+                          const gchar *folder_id,
+                          guint64 flags)
+{
+	GHashTable *type_index = map_summary->priv->type_index;
+	gpointer type = GUINT_TO_POINTER ((guint) (flags & CAMEL_FOLDER_TYPE_MASK));
+	GSList *ids, *link;
+
+	ids = g_hash_table_lookup (type_index, type);
+	link = g_slist_find_custom (ids, folder_id, (GCompareFunc) strcmp);
+	if (!link)
+		return;
+
+	g_hash_table_steal (type_index, type);
+	g_free (link->data);
+	ids = g_slist_delete_link (ids, link);
+	if (ids)
+		g_hash_table_insert (type_index, type, ids);
+}
+
+static void
+map_ss_id_list_free (GSList *ids)
+{
+	g_slist_free_full (ids, g_free);
+}
+
+/* Empties the name hashes and everything kept alongside them */
+static void
+map_ss_reset_indices (CamelMapStoreSummary *map_summary)
+{
+	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
+
+	g_hash_table_remove_all (priv->fname_id_hash);
+	g_hash_table_remove_all (priv->id_fname_hash);
+
+	if (priv->fname_trie)
+		map_ss_node_free (priv->fname_trie);
+	priv->fname_trie = map_ss_node_new (NULL, NULL);
+
+	g_hash_table_remove_all (priv->type_index);
+}
+
+static void
+map_ss_close (CamelMapStoreSummary *map_summary)
+{
+	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
+
+	/* Statements have to go before the connection; whatever was not
+	 * saved is rolled back with it */
+	g_hash_table_remove_all (priv->stmts);
+	if (priv->db) {
+		sqlite3_close (priv->db);
+		priv->db = NULL;
+	}
+	priv->dirty = FALSE;
+}
+
 static void
 map_store_summary_finalize (GObject *object)
 {
 	CamelMapStoreSummary *map_summary = CAMEL_MAP_STORE_SUMMARY (object);
 	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
 
-	g_key_file_free (priv->key_file);
+	map_ss_close (map_summary);
+	g_hash_table_destroy (priv->stmts);
 	g_free (priv->path);
 	g_hash_table_destroy (priv->fname_id_hash);
 	g_hash_table_destroy (priv->id_fname_hash);
+	map_ss_node_free (priv->fname_trie);
+	g_hash_table_destroy (priv->type_index);
 	g_static_rec_mutex_free (&priv->s_lock);
 	if (priv->monitor_delete)
 		g_object_unref (priv->monitor_delete);
@@ -63,16 +295,185 @@ camel_map_store_summary_init (CamelMapStoreSummary *map_summary)
 	priv = g_new0 (CamelMapStoreSummaryPrivate, 1);
 	map_summary->priv = priv;
 
-	priv->key_file = g_key_file_new ();
+	priv->stmts = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) sqlite3_finalize);
 	priv->dirty = FALSE;
 	priv->fname_id_hash = g_hash_table_new (g_str_hash, g_str_equal);
 	priv->id_fname_hash = g_hash_table_new_full (
 		g_str_hash, g_str_equal,
 		(GDestroyNotify) g_free,
 		(GDestroyNotify) g_free);
+	priv->fname_trie = map_ss_node_new (NULL, NULL);
+	priv->type_index = g_hash_table_new_full (
+		g_direct_hash, g_direct_equal, NULL,
+		(GDestroyNotify) map_ss_id_list_free);
 	g_static_rec_mutex_init (&priv->s_lock);
 }
 
+/* Statements are prepared once per connection and reused, keyed by
+ * their SQL text. Expects the summary lock to be held. */
+static sqlite3_stmt *
+map_ss_prepare (CamelMapStoreSummary *map_summary,
+                const gchar *sql)
+{
+	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
+	sqlite3_stmt *stmt;
+
+	if (!priv->db)
+		return NULL;
+
+	stmt = g_hash_table_lookup (priv->stmts, sql);
+	if (stmt) {
+		sqlite3_reset (stmt);
+		sqlite3_clear_bindings (stmt);
+		return stmt;
+	}
+
+	if (sqlite3_prepare_v2 (priv->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		g_warning ("CamelMapStoreSummary: %s: %s", sql, sqlite3_errmsg (priv->db));
+		return NULL;
+	}
+
+	g_hash_table_insert (priv->stmts, g_strdup (sql), stmt);
+
+	return stmt;
+}
+
+/* Changes are written straight into the database inside a transaction
+ * that stays open until the next save, so saving only commits what
+ * actually changed. Expects the summary lock to be held. */
+static gboolean
+map_ss_begin (CamelMapStoreSummary *map_summary)
+{
+	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
+
+	if (!priv->db)
+		return FALSE;
+
+	if (!priv->dirty &&
+	    sqlite3_exec (priv->db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK)
+		priv->dirty = TRUE;
+
+	return priv->dirty;
+}
+
+static void
+map_ss_step (CamelMapStoreSummary *map_summary,
+             sqlite3_stmt *stmt)
+{
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		g_warning (
+			"CamelMapStoreSummary: %s: %s", sqlite3_sql (stmt),
+			sqlite3_errmsg (map_summary->priv->db));
+	sqlite3_reset (stmt);
+}
+
+/* For the UPDATE statements taking the new value as ?1 and the folder
+ * id as ?2 */
+static void
+map_ss_set_text (CamelMapStoreSummary *map_summary,
+                 const gchar *sql,
+                 const gchar *folder_id,
+                 const gchar *value)
+{
+	sqlite3_stmt *stmt;
+
+	if (!map_ss_begin (map_summary) || !(stmt = map_ss_prepare (map_summary, sql)))
+		return;
+
+	sqlite3_bind_text (stmt, 1, value, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text (stmt, 2, folder_id, -1, SQLITE_TRANSIENT);
+	map_ss_step (map_summary, stmt);
+}
+
+static void
+map_ss_set_int (CamelMapStoreSummary *map_summary,
+                const gchar *sql,
+                const gchar *folder_id,
+                guint64 value)
+{
+	sqlite3_stmt *stmt;
+
+	if (!map_ss_begin (map_summary) || !(stmt = map_ss_prepare (map_summary, sql)))
+		return;
+
+	sqlite3_bind_int64 (stmt, 1, (sqlite3_int64) value);
+	sqlite3_bind_text (stmt, 2, folder_id, -1, SQLITE_TRANSIENT);
+	map_ss_step (map_summary, stmt);
+}
+
+/* Runs a SELECT of a single column taking the folder id (or store key)
+ * as ?1 and leaves the statement on its row; NULL with @error set if
+ * there is no such row. */
+static sqlite3_stmt *
+map_ss_get_row (CamelMapStoreSummary *map_summary,
+                const gchar *sql,
+                const gchar *folder_id,
+                GError **error)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = map_ss_prepare (map_summary, sql);
+	if (stmt) {
+		sqlite3_bind_text (stmt, 1, folder_id, -1, SQLITE_TRANSIENT);
+		if (sqlite3_step (stmt) == SQLITE_ROW)
+			return stmt;
+		sqlite3_reset (stmt);
+	}
+
+	g_set_error (
+		error, CAMEL_STORE_ERROR, CAMEL_STORE_ERROR_NO_FOLDER,
+		_("Folder summary has no entry for '%s'"), folder_id);
+
+	return NULL;
+}
+
+static gchar *
+map_ss_get_text (CamelMapStoreSummary *map_summary,
+                 const gchar *sql,
+                 const gchar *folder_id,
+                 GError **error)
+{
+	sqlite3_stmt *stmt;
+	gchar *ret = NULL;
+
+	S_LOCK (map_summary);
+
+	stmt = map_ss_get_row (map_summary, sql, folder_id, error);
+	if (stmt) {
+		ret = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+		sqlite3_reset (stmt);
+	}
+
+	S_UNLOCK (map_summary);
+
+	return ret;
+}
+
+static guint64
+map_ss_get_int (CamelMapStoreSummary *map_summary,
+                const gchar *sql,
+                const gchar *folder_id,
+                GError **error)
+{
+	sqlite3_stmt *stmt;
+	guint64 ret = 0;
+
+	S_LOCK (map_summary);
+
+	stmt = map_ss_get_row (map_summary, sql, folder_id, error);
+	if (stmt) {
+		ret = (guint64) sqlite3_column_int64 (stmt, 0);
+		sqlite3_reset (stmt);
+	}
+
+	S_UNLOCK (map_summary);
+
+	return ret;
+}
+
 static gchar *build_full_name (CamelMapStoreSummary *map_summary, const gchar *fid)
 {
 	gchar *pfid, *dname, *ret;
@@ -98,17 +499,42 @@ static gchar *build_full_name (CamelMapStoreSummary *map_summary, const gchar *f
 	return ret;
 }
 
+/* Full names are read back as stored; they are only built from the
+ * parent chain for rows that have none yet, or for all of them when
+ * @rebuild is set. */
 static void
-load_id_fname_hash (CamelMapStoreSummary *map_summary)
+load_id_fname_hash (CamelMapStoreSummary *map_summary,
+                    gboolean rebuild)
 {
-	GSList *folders, *l;
+	GSList *unnamed = NULL, *l;
+	sqlite3_stmt *stmt;
 
-	g_hash_table_remove_all (map_summary->priv->fname_id_hash);
-	g_hash_table_remove_all (map_summary->priv->id_fname_hash);
+	map_ss_reset_indices (map_summary);
 
-	folders = camel_map_store_summary_get_folders (map_summary, NULL);
+	stmt = map_ss_prepare (map_summary, "SELECT folder_id, full_name, flags FROM folders ORDER BY rowid");
+	if (!stmt)
+		return;
 
-	for (l = folders; l != NULL; l = g_slist_next (l)) {
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		gchar *id = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+		const gchar *fname = (const gchar *) sqlite3_column_text (stmt, 1);
+
+		map_ss_type_index_add (map_summary, id, (guint64) sqlite3_column_int64 (stmt, 2));
+
+		if (!fname || rebuild) {
+			unnamed = g_slist_prepend (unnamed, id);
+			continue;
+		}
+
+		fname = g_strdup (fname);
+		g_hash_table_insert (map_summary->priv->fname_id_hash, (gchar *) fname, id);
+		g_hash_table_insert (map_summary->priv->id_fname_hash, id, (gchar *) fname);
+		map_ss_trie_insert (map_summary, fname, id);
+	}
+	sqlite3_reset (stmt);
+
+	unnamed = g_slist_reverse (unnamed);
+	for (l = unnamed; l != NULL; l = g_slist_next (l)) {
 		gchar *id = l->data;
 		gchar *fname;
 
@@ -122,9 +548,14 @@ load_id_fname_hash (CamelMapStoreSummary *map_summary)
 		}
 		g_hash_table_insert (map_summary->priv->fname_id_hash, fname, id);
 		g_hash_table_insert (map_summary->priv->id_fname_hash, id, fname);
+		map_ss_trie_insert (map_summary, fname, id);
+
+		map_ss_set_text (
+			map_summary, "UPDATE folders SET full_name = ?1 WHERE folder_id = ?2",
+			id, fname);
 	}
 
-	g_slist_free (folders);
+	g_slist_free (unnamed);
 }
 
 /* we only care about delete and ignore create */
@@ -140,7 +571,7 @@ monitor_delete_cb (GFileMonitor *monitor,
 	if (event == G_FILE_MONITOR_EVENT_DELETED) {
 		S_LOCK (map_summary);
 
-		if (map_summary->priv->key_file)
+		if (map_summary->priv->db)
 			camel_map_store_summary_clear (map_summary);
 
 		S_UNLOCK (map_summary);
@@ -180,32 +611,139 @@ camel_map_store_summary_new (const gchar *path)
 	return map_summary;
 }
 
+/* Copies the GKeyFile based folder tree of older versions into the
+ * database. The caller commits and removes the key file only once that
+ * succeeded. An outdated key file is left out, the folders will be
+ * fetched again. */
+static void
+map_ss_migrate_key_file (CamelMapStoreSummary *map_summary,
+                         const gchar *legacy_path)
+{
+	GKeyFile *key_file;
+	gchar **groups;
+	gsize length, i;
+
+	key_file = g_key_file_new ();
+	if (!g_key_file_load_from_file (key_file, legacy_path, 0, NULL) ||
+	    g_key_file_get_integer (key_file, LEGACY_GROUP_NAME, "Version", NULL) != LEGACY_SUMMARY_VERSION) {
+		g_key_file_free (key_file);
+		return;
+	}
+
+	groups = g_key_file_get_groups (key_file, &length);
+	for (i = 0; i < length; i++) {
+		const gchar *fid = groups[i];
+		gchar *value;
+
+		if (!g_ascii_strcasecmp (fid, LEGACY_GROUP_NAME)) {
+			gchar **keys = g_key_file_get_keys (key_file, fid, NULL, NULL);
+			gint j;
+
+			for (j = 0; keys && keys[j]; j++) {
+				if (!strcmp (keys[j], "Version"))
+					continue;
+				value = g_key_file_get_string (key_file, fid, keys[j], NULL);
+				camel_map_store_summary_store_string_val (map_summary, keys[j], value);
+				g_free (value);
+			}
+			g_strfreev (keys);
+			continue;
+		}
+
+		value = g_key_file_get_string (key_file, fid, "DisplayName", NULL);
+		camel_map_store_summary_new_folder (
+			map_summary, fid, NULL, NULL, value,
+			g_key_file_get_uint64 (key_file, fid, "Flags", NULL),
+			g_key_file_get_uint64 (key_file, fid, "Total", NULL));
+		g_free (value);
+
+		value = g_key_file_get_string (key_file, fid, "ParentFolderId", NULL);
+		camel_map_store_summary_set_parent_folder_id (map_summary, fid, value);
+		g_free (value);
+
+		value = g_key_file_get_string (key_file, fid, "ChangeKey", NULL);
+		camel_map_store_summary_set_change_key (map_summary, fid, value);
+		g_free (value);
+
+		value = g_key_file_get_string (key_file, fid, "SyncState", NULL);
+		camel_map_store_summary_set_sync_state (map_summary, fid, value);
+		g_free (value);
+
+		camel_map_store_summary_set_folder_unread (
+			map_summary, fid,
+			g_key_file_get_uint64 (key_file, fid, "UnRead", NULL));
+	}
+	g_strfreev (groups);
+	g_key_file_free (key_file);
+}
+
 gboolean
 camel_map_store_summary_load (CamelMapStoreSummary *map_summary,
                               GError **error)
 {
 	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
-	gboolean ret;
-	gint version;
+	sqlite3_stmt *stmt;
+	gchar *dir, *legacy_path = NULL;
+	gboolean ret = TRUE, rebuild = FALSE;
+	gint version = 0;
 
 	S_LOCK (map_summary);
 
-	ret = g_key_file_load_from_file (
-		priv->key_file, priv->path, 0, error);
+	map_ss_close (map_summary);
+
+	if (sqlite3_open_v2 (priv->path, &priv->db,
+			     SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+			     SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK ||
+	    sqlite3_exec (priv->db, SUMMARY_SCHEMA, NULL, NULL, NULL) != SQLITE_OK) {
+		g_set_error (
+			error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Could not open folder summary %s: %s"),
+			priv->path, sqlite3_errmsg (priv->db));
+		map_ss_close (map_summary);
+		S_UNLOCK (map_summary);
+		return FALSE;
+	}
 
-	version = g_key_file_get_integer (
-		priv->key_file, STORE_GROUP_NAME, "Version", NULL);
+	stmt = map_ss_prepare (map_summary, "PRAGMA user_version");
+	if (stmt && sqlite3_step (stmt) == SQLITE_ROW)
+		version = sqlite3_column_int (stmt, 0);
+	if (stmt)
+		sqlite3_reset (stmt);
 
 	if (version != CURRENT_SUMMARY_VERSION) {
 		/* version doesn't match, get folders again */
 		camel_map_store_summary_clear (map_summary);
 
-		g_key_file_set_integer (
-			priv->key_file, STORE_GROUP_NAME,
-			"Version", CURRENT_SUMMARY_VERSION);
+		/* Only a new database takes over the old folder tree */
+		dir = g_path_get_dirname (priv->path);
+		legacy_path = g_build_filename (dir, LEGACY_SUMMARY_FILE, NULL);
+		if (!version && g_file_test (legacy_path, G_FILE_TEST_EXISTS)) {
+			map_ss_migrate_key_file (map_summary, legacy_path);
+			/* Folders came in any order, name them now that
+			 * all their parents are there */
+			rebuild = TRUE;
+		} else {
+			g_free (legacy_path);
+			legacy_path = NULL;
+		}
+		g_free (dir);
+
+		/* A PRAGMA can't take parameters */
+		map_ss_begin (map_summary);
+		sqlite3_exec (
+			priv->db, "PRAGMA user_version = "
+			G_STRINGIFY (CURRENT_SUMMARY_VERSION), NULL, NULL, NULL);
 	}
 
-	load_id_fname_hash (map_summary);
+	load_id_fname_hash (map_summary, rebuild);
+
+	/* Keep what migrating or naming folders wrote */
+	ret = camel_map_store_summary_save (map_summary, error);
+
+	/* Without the commit the next load migrates again */
+	if (legacy_path && ret)
+		g_unlink (legacy_path);
+	g_free (legacy_path);
 
 	S_UNLOCK (map_summary);
 
@@ -218,40 +756,41 @@ camel_map_store_summary_save (CamelMapStoreSummary *map_summary,
 {
 	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
 	gboolean ret = TRUE;
-	GFile *file;
-	gchar *contents = NULL;
 
 	S_LOCK (map_summary);
 
 	if (!priv->dirty)
 		goto exit;
 
-	contents = g_key_file_to_data (
-		priv->key_file, NULL, NULL);
-	file = g_file_new_for_path (priv->path);
-	ret = g_file_replace_contents (
-		file, contents, strlen (contents),
-		NULL, FALSE, G_FILE_CREATE_PRIVATE,
-		NULL, NULL, error);
-	g_object_unref (file);
+	if (sqlite3_exec (priv->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		g_set_error (
+			error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Could not save folder summary %s: %s"),
+			priv->path, sqlite3_errmsg (priv->db));
+		sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+		ret = FALSE;
+	}
 	priv->dirty = FALSE;
 
 exit:
 	S_UNLOCK (map_summary);
 
-	g_free (contents);
 	return ret;
 }
 
 gboolean
 camel_map_store_summary_clear (CamelMapStoreSummary *map_summary)
 {
+	CamelMapStoreSummaryPrivate *priv = map_summary->priv;
 
 	S_LOCK (map_summary);
 
-	g_key_file_free (map_summary->priv->key_file);
-	map_summary->priv->key_file = g_key_file_new ();
-	map_summary->priv->dirty = TRUE;
+	if (map_ss_begin (map_summary))
+		sqlite3_exec (
+			priv->db, "DELETE FROM folders; DELETE FROM store",
+			NULL, NULL, NULL);
+
+	map_ss_reset_indices (map_summary);
 
 	S_UNLOCK (map_summary);
 
@@ -262,14 +801,20 @@ gboolean
 camel_map_store_summary_remove (CamelMapStoreSummary *map_summary)
 {
 	gint ret;
+	gchar *journal;
 
 	S_LOCK (map_summary);
 
-	if (map_summary->priv->key_file)
+	if (map_summary->priv->db)
 		camel_map_store_summary_clear (map_summary);
+	map_ss_close (map_summary);
 
 	ret = g_unlink (map_summary->priv->path);
 
+	journal = g_strconcat (map_summary->priv->path, "-journal", NULL);
+	g_unlink (journal);
+	g_free (journal);
+
 	S_UNLOCK (map_summary);
 
 	return (ret == 0);
@@ -281,27 +826,10 @@ camel_map_store_summary_rebuild_hashes (CamelMapStoreSummary *map_summary)
 	g_return_if_fail (CAMEL_IS_MAP_STORE_SUMMARY (map_summary));
 
 	S_LOCK (map_summary);
-	load_id_fname_hash (map_summary);
+	load_id_fname_hash (map_summary, TRUE);
 	S_UNLOCK (map_summary);
 }
 
-struct subfolder_match {
-	GSList *ids;
-	gchar *match;
-	gsize matchlen;
-};
-
-static void
-match_subfolder (gpointer key,
-                 gpointer value,
-                 gpointer user_data)
-{
-	struct subfolder_match *sm = user_data;
-
-	if (!strncmp (key, sm->match, sm->matchlen))
-		sm->ids = g_slist_prepend (sm->ids, g_strdup (value));
-}
-
 /* Must be called with the summary lock held, and gets to keep
  * both its string arguments */
 static void
@@ -311,11 +839,15 @@ map_ss_hash_replace (CamelMapStoreSummary *map_summary,
                      gboolean recurse)
 {
 	const gchar *ofname;
-	struct subfolder_match sm = { NULL, NULL };
+	GSList *subfolders = NULL;
 
 	if (!full_name)
 		full_name = build_full_name (map_summary, folder_id);
 
+	map_ss_set_text (
+		map_summary, "UPDATE folders SET full_name = ?1 WHERE folder_id = ?2",
+		folder_id, full_name);
+
 	ofname = g_hash_table_lookup (
 		map_summary->priv->id_fname_hash, folder_id);
 	/* Remove the old fullname->id hash entry *iff* it's pointing
@@ -324,33 +856,31 @@ map_ss_hash_replace (CamelMapStoreSummary *map_summary,
 		gchar *ofid = g_hash_table_lookup (
 			map_summary->priv->fname_id_hash, ofname);
 		if (!strcmp (folder_id, ofid)) {
+			/* Whatever was below the old name moves along */
+			if (recurse)
+				map_ss_trie_collect (
+					map_ss_trie_lookup (map_summary->priv->fname_trie, ofname, FALSE),
+					&subfolders);
+			map_ss_trie_remove (map_summary, ofname);
 			g_hash_table_remove (
 				map_summary->priv->fname_id_hash, ofname);
-			if (recurse)
-				sm.match = g_strdup_printf ("%s/", ofname);
 		}
 	}
 
 	g_hash_table_insert (map_summary->priv->fname_id_hash, full_name, folder_id);
+	map_ss_trie_insert (map_summary, full_name, folder_id);
 
 	/* Replace, not insert. The difference is that it frees the *old* folder_id
 	 * key, not the new one which we just inserted into fname_id_hash too. */
 	g_hash_table_replace (map_summary->priv->id_fname_hash, folder_id, full_name);
 
-	if (sm.match) {
+	if (subfolders) {
 		GSList *l;
 
-		sm.matchlen = strlen (sm.match);
-
-		g_hash_table_foreach (
-			map_summary->priv->fname_id_hash,
-			match_subfolder, &sm);
-
-		for (l = sm.ids; l; l = g_slist_next (l))
+		for (l = subfolders; l; l = g_slist_next (l))
 			map_ss_hash_replace (map_summary, l->data, NULL, FALSE);
 
-		g_slist_free (sm.ids);
-		g_free (sm.match);
+		g_slist_free (subfolders);
 	}
 }
 
@@ -361,12 +891,11 @@ camel_map_store_summary_set_folder_name (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	g_key_file_set_string (
-		map_summary->priv->key_file,
-		folder_id, "DisplayName", display_name);
+	map_ss_set_text (
+		map_summary, "UPDATE folders SET display_name = ?1 WHERE folder_id = ?2",
+		folder_id, display_name);
 
 	map_ss_hash_replace (map_summary, g_strdup (folder_id), NULL, TRUE);
-	map_summary->priv->dirty = TRUE;
 
 	S_UNLOCK (map_summary);
 }
@@ -380,30 +909,41 @@ camel_map_store_summary_new_folder (CamelMapStoreSummary *map_summary,
                                     guint64 folder_flags,
                                     guint64 total)
 {
+	sqlite3_stmt *stmt;
 
 	S_LOCK (map_summary);
 
-	if (parent_fid)
-		g_key_file_set_string (
-			map_summary->priv->key_file,
-			folder_id, "ParentFolderId", parent_fid);
-	if (change_key)
-		g_key_file_set_string (
-			map_summary->priv->key_file,
-			folder_id, "ChangeKey", change_key);
-	g_key_file_set_string (
-		map_summary->priv->key_file,
-		folder_id, "DisplayName", display_name);
-	g_key_file_set_uint64 (
-		map_summary->priv->key_file,
-		folder_id, "Flags", folder_flags);
-	g_key_file_set_uint64 (
-		map_summary->priv->key_file,
-		folder_id, "Total", total);
+	map_ss_type_index_remove (
+		map_summary, folder_id,
+		camel_map_store_summary_get_folder_flags (map_summary, folder_id, NULL));
+	map_ss_type_index_add (map_summary, folder_id, folder_flags);
 
-	map_ss_hash_replace (map_summary, g_strdup (folder_id), NULL, FALSE);
+	/* An existing folder keeps the values not given here */
+	if (map_ss_begin (map_summary) &&
+	    (stmt = map_ss_prepare (map_summary, "INSERT OR IGNORE INTO folders (folder_id) VALUES (?1)"))) {
+		sqlite3_bind_text (stmt, 1, folder_id, -1, SQLITE_TRANSIENT);
+		map_ss_step (map_summary, stmt);
+	}
 
-	map_summary->priv->dirty = TRUE;
+	stmt = map_ss_prepare (
+		map_summary,
+		"UPDATE folders SET"
+		" parent_id = COALESCE (?2, parent_id),"
+		" change_key = COALESCE (?3, change_key),"
+		" display_name = ?4, flags = ?5, type = ?6, total = ?7"
+		" WHERE folder_id = ?1");
+	if (stmt) {
+		sqlite3_bind_text (stmt, 1, folder_id, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text (stmt, 2, parent_fid, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text (stmt, 3, change_key, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text (stmt, 4, display_name, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int64 (stmt, 5, (sqlite3_int64) folder_flags);
+		sqlite3_bind_int64 (stmt, 6, (sqlite3_int64) (folder_flags & CAMEL_FOLDER_TYPE_MASK));
+		sqlite3_bind_int64 (stmt, 7, (sqlite3_int64) total);
+		map_ss_step (map_summary, stmt);
+	}
+
+	map_ss_hash_replace (map_summary, g_strdup (folder_id), NULL, FALSE);
 
 	S_UNLOCK (map_summary);
 }
@@ -415,19 +955,12 @@ camel_map_store_summary_set_parent_folder_id (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	if (parent_id)
-		g_key_file_set_string (
-			map_summary->priv->key_file,
-			folder_id, "ParentFolderId", parent_id);
-	else
-		g_key_file_remove_key (
-			map_summary->priv->key_file,
-			folder_id, "ParentFolderId", NULL);
+	map_ss_set_text (
+		map_summary, "UPDATE folders SET parent_id = ?1 WHERE folder_id = ?2",
+		folder_id, parent_id);
 
 	map_ss_hash_replace (map_summary, g_strdup (folder_id), NULL, TRUE);
 
-	map_summary->priv->dirty = TRUE;
-
 	S_UNLOCK (map_summary);
 }
 
@@ -438,10 +971,9 @@ camel_map_store_summary_set_change_key (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	g_key_file_set_string (
-		map_summary->priv->key_file,
-		folder_id, "ChangeKey", change_key);
-	map_summary->priv->dirty = TRUE;
+	map_ss_set_text (
+		map_summary, "UPDATE folders SET change_key = ?1 WHERE folder_id = ?2",
+		folder_id, change_key);
 
 	S_UNLOCK (map_summary);
 }
@@ -453,10 +985,9 @@ camel_map_store_summary_set_sync_state (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	g_key_file_set_string (
-		map_summary->priv->key_file,
-		folder_id, "SyncState", sync_state);
-	map_summary->priv->dirty = TRUE;
+	map_ss_set_text (
+		map_summary, "UPDATE folders SET sync_state = ?1 WHERE folder_id = ?2",
+		folder_id, sync_state);
 
 	S_UNLOCK (map_summary);
 }
@@ -468,10 +999,17 @@ camel_map_store_summary_set_folder_flags (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	g_key_file_set_uint64 (
-		map_summary->priv->key_file,
-		folder_id, "Flags", flags);
-	map_summary->priv->dirty = TRUE;
+	map_ss_type_index_remove (
+		map_summary, folder_id,
+		camel_map_store_summary_get_folder_flags (map_summary, folder_id, NULL));
+	map_ss_type_index_add (map_summary, folder_id, flags);
+
+	map_ss_set_int (
+		map_summary, "UPDATE folders SET flags = ?1 WHERE folder_id = ?2",
+		folder_id, flags);
+	map_ss_set_int (
+		map_summary, "UPDATE folders SET type = ?1 WHERE folder_id = ?2",
+		folder_id, flags & CAMEL_FOLDER_TYPE_MASK);
 
 	S_UNLOCK (map_summary);
 }
@@ -483,10 +1021,9 @@ camel_map_store_summary_set_folder_unread (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	g_key_file_set_uint64 (
-		map_summary->priv->key_file,
-		folder_id, "UnRead", unread);
-	map_summary->priv->dirty = TRUE;
+	map_ss_set_int (
+		map_summary, "UPDATE folders SET unread = ?1 WHERE folder_id = ?2",
+		folder_id, unread);
 
 	S_UNLOCK (map_summary);
 }
@@ -498,10 +1035,9 @@ camel_map_store_summary_set_folder_total (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	g_key_file_set_uint64 (
-		map_summary->priv->key_file,
-		folder_id, "Total", total);
-	map_summary->priv->dirty = TRUE;
+	map_ss_set_int (
+		map_summary, "UPDATE folders SET total = ?1 WHERE folder_id = ?2",
+		folder_id, total);
 
 	S_UNLOCK (map_summary);
 }
@@ -515,10 +1051,9 @@ camel_map_store_summary_store_string_val (CamelMapStoreSummary *map_summary,
 {
 	S_LOCK (map_summary);
 
-	g_key_file_set_string (
-		map_summary->priv->key_file,
-		STORE_GROUP_NAME, key, value);
-	map_summary->priv->dirty = TRUE;
+	map_ss_set_text (
+		map_summary, "INSERT OR REPLACE INTO store (value, key) VALUES (?1, ?2)",
+		key, value);
 
 	S_UNLOCK (map_summary);
 }
@@ -528,17 +1063,9 @@ camel_map_store_summary_get_folder_name (CamelMapStoreSummary *map_summary,
                                          const gchar *folder_id,
                                          GError **error)
 {
-	gchar *ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_string (
-		map_summary->priv->key_file, folder_id,
-		"DisplayName", error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
+	return map_ss_get_text (
+		map_summary, "SELECT display_name FROM folders WHERE folder_id = ?1",
+		folder_id, error);
 }
 
 gchar *
@@ -565,17 +1092,9 @@ camel_map_store_summary_get_parent_folder_id (CamelMapStoreSummary *map_summary,
                                               const gchar *folder_id,
                                               GError **error)
 {
-	gchar *ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_string (
-		map_summary->priv->key_file, folder_id,
-		"ParentFolderId", error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
+	return map_ss_get_text (
+		map_summary, "SELECT parent_id FROM folders WHERE folder_id = ?1",
+		folder_id, error);
 }
 
 gchar *
@@ -583,17 +1102,9 @@ camel_map_store_summary_get_change_key (CamelMapStoreSummary *map_summary,
                                         const gchar *folder_id,
                                         GError **error)
 {
-	gchar *ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_string (
-		map_summary->priv->key_file, folder_id,
-		"ChangeKey", error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
+	return map_ss_get_text (
+		map_summary, "SELECT change_key FROM folders WHERE folder_id = ?1",
+		folder_id, error);
 }
 
 gchar *
@@ -601,17 +1112,9 @@ camel_map_store_summary_get_sync_state (CamelMapStoreSummary *map_summary,
                                         const gchar *folder_id,
                                         GError **error)
 {
-	gchar *ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_string (
-		map_summary->priv->key_file, folder_id,
-		"SyncState", error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
+	return map_ss_get_text (
+		map_summary, "SELECT sync_state FROM folders WHERE folder_id = ?1",
+		folder_id, error);
 }
 
 guint64
@@ -619,17 +1122,9 @@ camel_map_store_summary_get_folder_flags (CamelMapStoreSummary *map_summary,
                                           const gchar *folder_id,
                                           GError **error)
 {
-	guint64 ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_uint64 (
-		map_summary->priv->key_file, folder_id,
-		"Flags", error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
+	return map_ss_get_int (
+		map_summary, "SELECT flags FROM folders WHERE folder_id = ?1",
+		folder_id, error);
 }
 
 guint64
@@ -637,17 +1132,9 @@ camel_map_store_summary_get_folder_unread (CamelMapStoreSummary *map_summary,
                                            const gchar *folder_id,
                                            GError **error)
 {
-	guint64 ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_uint64 (
-		map_summary->priv->key_file, folder_id,
-		"UnRead", error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
+	return map_ss_get_int (
+		map_summary, "SELECT unread FROM folders WHERE folder_id = ?1",
+		folder_id, error);
 }
 
 guint64
@@ -655,17 +1142,9 @@ camel_map_store_summary_get_folder_total (CamelMapStoreSummary *map_summary,
                                           const gchar *folder_id,
                                           GError **error)
 {
-	guint64 ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_uint64 (
-		map_summary->priv->key_file, folder_id,
-		"Total", error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
+	return map_ss_get_int (
+		map_summary, "SELECT total FROM folders WHERE folder_id = ?1",
+		folder_id, error);
 }
 
 gchar *
@@ -673,17 +1152,9 @@ camel_map_store_summary_get_string_val (CamelMapStoreSummary *map_summary,
                                          const gchar *key,
                                          GError **error)
 {
-	gchar *ret;
-
-	S_LOCK (map_summary);
-
-	ret = g_key_file_get_string (
-		map_summary->priv->key_file, STORE_GROUP_NAME,
+	return map_ss_get_text (
+		map_summary, "SELECT value FROM store WHERE key = ?1",
 		key, error);
-
-	S_UNLOCK (map_summary);
-
-	return ret;
 }
 
 GSList *
@@ -691,38 +1162,36 @@ camel_map_store_summary_get_folders (CamelMapStoreSummary *map_summary,
                                      const gchar *prefix)
 {
 	GSList *folders = NULL;
-	gchar **groups = NULL;
-	gsize length;
-	gint prefixlen = 0;
-	gint i;
-
-	if (prefix)
-		prefixlen = strlen (prefix);
+	sqlite3_stmt *stmt;
 
 	S_LOCK (map_summary);
 
-	groups = g_key_file_get_groups (map_summary->priv->key_file, &length);
+	/* Only the subtree below @prefix is visited */
+	if (prefix && *prefix) {
+		MapSsNode *node;
 
-	S_UNLOCK (map_summary);
-
-	for (i = 0; i < length; i++) {
-		if (!g_ascii_strcasecmp (groups[i], STORE_GROUP_NAME))
-			continue;
-		if (prefixlen) {
-			const gchar *fname;
+		node = map_ss_trie_lookup (map_summary->priv->fname_trie, prefix, FALSE);
+		if (node) {
+			map_ss_trie_collect (node, &folders);
+			if (node->folder_id)
+				folders = g_slist_prepend (folders, g_strdup (node->folder_id));
+		}
 
-			fname = g_hash_table_lookup (
-				map_summary->priv->id_fname_hash, groups[i]);
+		S_UNLOCK (map_summary);
 
-			if (!fname || strncmp (fname, prefix, prefixlen) ||
-			    (fname[prefixlen] && fname[prefixlen] != '/'))
-				continue;
-		}
-		folders = g_slist_append (folders, g_strdup (groups[i]));
+		return folders;
 	}
 
-	g_strfreev (groups);
-	return folders;
+	stmt = map_ss_prepare (map_summary, "SELECT folder_id FROM folders ORDER BY rowid");
+	while (stmt && sqlite3_step (stmt) == SQLITE_ROW)
+		folders = g_slist_prepend (
+			folders, g_strdup ((const gchar *) sqlite3_column_text (stmt, 0)));
+	if (stmt)
+		sqlite3_reset (stmt);
+
+	S_UNLOCK (map_summary);
+
+	return g_slist_reverse (folders);
 }
 
 gboolean
@@ -732,6 +1201,7 @@ camel_map_store_summary_remove_folder (CamelMapStoreSummary *map_summary,
 {
 	gboolean ret = FALSE;
 	gchar *full_name;
+	sqlite3_stmt *stmt;
 
 	S_LOCK (map_summary);
 
@@ -739,14 +1209,21 @@ camel_map_store_summary_remove_folder (CamelMapStoreSummary *map_summary,
 	if (!full_name)
 		goto unlock;
 
-	ret = g_key_file_remove_group (
-		map_summary->priv->key_file, folder_id, error);
+	map_ss_type_index_remove (
+		map_summary, folder_id,
+		camel_map_store_summary_get_folder_flags (map_summary, folder_id, NULL));
+
+	if (map_ss_begin (map_summary) &&
+	    (stmt = map_ss_prepare (map_summary, "DELETE FROM folders WHERE folder_id = ?1"))) {
+		sqlite3_bind_text (stmt, 1, folder_id, -1, SQLITE_TRANSIENT);
+		map_ss_step (map_summary, stmt);
+		ret = TRUE;
+	}
 
+	map_ss_trie_remove (map_summary, full_name);
 	g_hash_table_remove (map_summary->priv->fname_id_hash, full_name);
 	g_hash_table_remove (map_summary->priv->id_fname_hash, folder_id);
 
-	map_summary->priv->dirty = TRUE;
-
  unlock:
 	S_UNLOCK (map_summary);
 
@@ -778,7 +1255,7 @@ camel_map_store_summary_get_folder_id_from_folder_type (CamelMapStoreSummary *ma
                                                         guint64 folder_type)
 {
 	gchar *folder_id = NULL;
-	GSList *folders, *l;
+	GSList *ids;
 
 	g_return_val_if_fail (map_summary != NULL, NULL);
 	g_return_val_if_fail ((folder_type & CAMEL_FOLDER_TYPE_MASK) != 0, NULL);
@@ -787,23 +1264,11 @@ camel_map_store_summary_get_folder_id_from_folder_type (CamelMapStoreSummary *ma
 
 	S_LOCK (map_summary);
 
-	folders = camel_map_store_summary_get_folders (map_summary, NULL);
-
-	for (l = folders; l != NULL; l = g_slist_next (l)) {
-		gchar *id = l->data;
-		guint64 folder_flags;
-
-		folder_flags = camel_map_store_summary_get_folder_flags (
-			map_summary, id, NULL);
-		if ((folder_flags & CAMEL_FOLDER_TYPE_MASK) == folder_type &&
-		    (folder_flags & CAMEL_FOLDER_SYSTEM) != 0) {
-			folder_id = id;
-			l->data = NULL;
-			break;
-		}
-	}
-
-	g_slist_free_full (folders, g_free);
+	ids = g_hash_table_lookup (
+		map_summary->priv->type_index,
+		GUINT_TO_POINTER ((guint) folder_type));
+	if (ids)
+		folder_id = g_strdup (ids->data);
 
 	S_UNLOCK (map_summary);
 
@@ -814,11 +1279,17 @@ gboolean
 camel_map_store_summary_has_folder (CamelMapStoreSummary *map_summary,
                                     const gchar *folder_id)
 {
-	gboolean ret;
+	sqlite3_stmt *stmt;
+	gboolean ret = FALSE;
 
 	S_LOCK (map_summary);
 
-	ret = g_key_file_has_group (map_summary->priv->key_file, folder_id);
+	stmt = map_ss_prepare (map_summary, "SELECT 1 FROM folders WHERE folder_id = ?1");
+	if (stmt) {
+		sqlite3_bind_text (stmt, 1, folder_id, -1, SQLITE_TRANSIENT);
+		ret = sqlite3_step (stmt) == SQLITE_ROW;
+		sqlite3_reset (stmt);
+	}
 
 	S_UNLOCK (map_summary);
 
@@ -59,9 +59,16 @@
 
 #define FINFO_REFRESH_INTERVAL 60
 
-#define CURRENT_FOLDER_LOCK() g_rec_mutex_lock(&map_store->priv->current_folder_lock);
-#define CURRENT_FOLDER_UNLOCK() g_rec_mutex_unlock(&map_store->priv->current_folder_lock);
-#define CURRENT_FOLDER(folder) g_free(map_store->priv->current_selected_folder); map_store->priv->current_selected_folder = g_strdup(folder); printf("Setting current folder to %s\n", folder);
+#define CURRENT_FOLDER_LOCK() camel_map_store_folder_lock (map_store, CAMEL_MAP_OPERATION_REFRESH, NULL);
+#define CURRENT_FOLDER_UNLOCK() camel_map_store_folder_unlock (map_store);
+#define CURRENT_FOLDER(folder) \
+	do { \
+		g_mutex_lock (map_store->priv->sched_lock); \
+		g_free (map_store->priv->current_selected_folder); \
+		map_store->priv->current_selected_folder = g_strdup (folder); \
+		g_mutex_unlock (map_store->priv->sched_lock); \
+		d (g_debug ("Setting current folder to %s", (folder) ? (folder) : "/")); \
+	} while (0)
 
 struct _CamelMapStorePrivate {
 	char *session_path;
@@ -70,16 +77,57 @@ struct _CamelMapStorePrivate {
 	GDBusConnection *connection;	
 	time_t last_refresh_time;
 	GMutex *get_finfo_lock;
-	GMutex *connection_lock;
-	GRecMutex current_folder_lock;
-	char *current_selected_folder;
+	GMutex *connection_lock;	/* taken after the cursor, never before */
+	/* The remote cursor (the session's current folder) is handed
+	 * out by priority, see camel_map_store_folder_lock() */
+	GMutex *sched_lock;
+	GCond *sched_cond;
+	GThread *sched_owner;
+	guint sched_depth;
+	GList *sched_waiters;
+	guint sched_serial;
+	GQueue *op_queue;
+	gboolean op_running;
+	char *current_selected_folder;	/* changed by the cursor owner, under sched_lock */
 	gboolean initial_fetch;
+	gint fractions_supported;	/* read and cleared from several jobs, atomic */
+
+	/* Background body prefetch, see camel_map_store_queue_prefetch() */
+	GMutex *prefetch_lock;
+	GCond *prefetch_cond;
+	GQueue *prefetch_queue;
+	gboolean prefetch_running;
+	guint prefetch_budget_messages;
+	guint64 prefetch_budget_bytes;
+	guint foreground_fetches;
 };
 
+typedef struct _MapSchedWaiter {
+	CamelMapOperationPriority priority;
+	const gchar *map_dir;
+	guint serial;
+} MapSchedWaiter;
+
+typedef struct _MapOperation {
+	MapSchedWaiter waiter;
+	gchar *map_dir;
+	CamelMapOperationFunc func;
+	gpointer user_data;
+	GDestroyNotify destroy;
+} MapOperation;
+
+typedef struct _MapPrefetchItem {
+	CamelFolder *folder;
+	gchar *uid;
+	guint32 size;
+	time_t date;
+} MapPrefetchItem;
+
 static gboolean	map_store_construct	(CamelService *service, CamelSession *session,
 					 CamelProvider *provider, GError **error);
 
 static void camel_map_store_initable_init (GInitableIface *interface);
+static void map_store_operations_clear (CamelMapStore *map_store);
 static void camel_map_subscribable_init (CamelSubscribableInterface *interface);
 static GInitableIface *parent_initable_interface;
 
@@ -151,7 +199,7 @@ map_store_construct (CamelService *service,
 	/* Note. update account-listener plugin if filename is changed here, as it would remove the summary
 	 * by forming the path itself */
 	g_mkdir_with_parents (map_store->storage_path, 0700);
-	summary_file = g_build_filename (map_store->storage_path, "folder-tree", NULL);
+	summary_file = g_build_filename (map_store->storage_path, "folder-tree.db", NULL);
 	map_store->summary = camel_map_store_summary_new (summary_file);
 	camel_map_store_summary_load (map_store->summary, NULL);
 
@@ -185,6 +233,96 @@ transfer_error (GDBusConnection *connection,
 	printf("%s: error\n", signal_name);
 }
 
+/* Plans the cheapest way to move the remote cursor from 'from' to 'to',
+ * both absolute paths. Every path component costs one OBEX SETPATH, so
+ * we either climb to the common ancestor with ".." and descend, or go
+ * through the root when that is no longer. Returns the path to hand over
+ * to SetFolder, or NULL when the cursor is already there. */
+static gchar *
+map_store_plan_navigation (const gchar *from,
+			   const gchar *to)
+{
+	gchar **from_parts, **to_parts;
+	GString *path;
+	guint from_len, to_len, common = 0, i;
+
+	if (from == NULL)
+		return g_strdup (to);
+
+	if (strcmp (from, to) == 0)
+		return NULL;
+
+	from_parts = g_strsplit (from + 1, "/", -1);
+	to_parts = g_strsplit (to + 1, "/", -1);
+	from_len = g_strv_length (from_parts);
+	to_len = g_strv_length (to_parts);
+
+	while (common < from_len && common < to_len &&
+	       strcmp (from_parts[common], to_parts[common]) == 0)
+		common++;
+
+	/* Going through the root costs the root move plus every component */
+	if (1 + to_len <= (from_len - common) + (to_len - common)) {
+		g_strfreev (from_parts);
+		g_strfreev (to_parts);
+		return g_strdup (to);
+	}
+
+	path = g_string_new ("");
+	for (i = common; i < from_len; i++)
+		g_string_append (path, path->len ? "/.." : "..");
+	for (i = common; i < to_len; i++) {
+		if (path->len)
+			g_string_append_c (path, '/');
+		g_string_append (path, to_parts[i]);
+	}
+
+	g_strfreev (from_parts);
+	g_strfreev (to_parts);
+
+	return g_string_free (path, FALSE);
+}
+
+/* Moves the remote cursor to folder. With force, SetFolder is sent with
+ * the absolute path even if we believe we are already there. Expects
+ * the current folder lock to be held. */
+static gboolean
+map_store_navigate (CamelMapStore *map_store,
+		    const gchar *folder,
+		    gboolean force,
+		    GCancellable *cancellable,
+		    GError **error)
+{
+	GVariant *ret;
+	gchar *path;
+
+	if (force)
+		path = g_strdup (folder);
+	else
+		path = map_store_plan_navigation (map_store->priv->current_selected_folder, folder);
+
+	if (path == NULL)
+		return TRUE;
+
+	ret = camel_map_dbus_set_current_folder (map_store->priv->map,
+						 path,
+						 cancellable,
+						 error);
+	g_free (path);
+
+	if (ret == NULL) {
+		/* The device may have stopped half way, so we no longer
+		 * know where we are. Next move will start from the root. */
+		d (g_debug ("Set folder to %s failed", folder ? folder : "/"));
+		CURRENT_FOLDER (NULL);
+		return FALSE;
+	}
+	g_variant_unref (ret);
+	CURRENT_FOLDER(folder);
+
+	return TRUE;
+}
+
 static gboolean
 map_connect_sync (CamelService *service,
                   GCancellable *cancellable,
@@ -237,6 +375,9 @@ map_connect_sync (CamelService *service,
 					cancellable,
 					error);
 
+	/* Assume fractional Get works until the daemon says otherwise */
+	g_atomic_int_set (&map_store->priv->fractions_supported, 1);
+
 	g_dbus_connection_signal_subscribe (map_store->priv->connection,
 			NULL,
 			"org.bluez.obex.Transfer1",
@@ -261,17 +402,11 @@ map_connect_sync (CamelService *service,
 
 
 	CURRENT_FOLDER_LOCK();
-	ret = camel_map_dbus_set_current_folder (map_store->priv->map,
-						 "/telecom/msg",
-						 cancellable,
-						 error);
-	if (ret == NULL) {
+	if (!map_store_navigate (map_store, "/telecom/msg", FALSE, cancellable, error)) {
 		printf("Set folder to telecom/msg failed\n");
 		CURRENT_FOLDER_UNLOCK();
 		return FALSE;
 	}
-	CURRENT_FOLDER("/telecom/msg");
-	printf("SETFOLDER: %s\n", g_variant_print (ret, TRUE));
 
 	ret = camel_map_dbus_get_folder_listing (map_store->priv->map,
 						 cancellable,
@@ -294,6 +429,95 @@ map_connect_sync (CamelService *service,
 	return success;
 }
 
+static void
+map_prefetch_item_free (MapPrefetchItem *item)
+{
+	g_object_unref (item->folder);
+	g_free (item->uid);
+	g_free (item);
+}
+
+/* Newest first */
+static gint
+map_prefetch_item_cmp (gconstpointer a,
+		       gconstpointer b,
+		       gpointer user_data)
+{
+	const MapPrefetchItem *item_a = a, *item_b = b;
+
+	if (item_a->date == item_b->date)
+		return 0;
+
+	return item_a->date > item_b->date ? -1 : 1;
+}
+
+/* Expects the prefetch lock to be held */
+static void
+map_store_prefetch_clear (CamelMapStore *map_store)
+{
+	MapPrefetchItem *item;
+
+	while ((item = g_queue_pop_head (map_store->priv->prefetch_queue)))
+		map_prefetch_item_free (item);
+}
+
+static void
+map_store_prefetch_job (CamelSession *session,
+			GCancellable *cancellable,
+			CamelMapStore *map_store,
+			GError **error)
+{
+	CamelMapStorePrivate *priv = map_store->priv;
+	MapPrefetchItem *item;
+
+	while (TRUE) {
+		GError *local_error = NULL;
+		gboolean fetch = TRUE;
+
+		g_mutex_lock (priv->prefetch_lock);
+
+		/* Let whatever the user is waiting for go first */
+		while (priv->foreground_fetches > 0)
+			g_cond_wait (priv->prefetch_cond, priv->prefetch_lock);
+
+		item = g_queue_pop_head (priv->prefetch_queue);
+		if (!item || !priv->prefetch_budget_messages ||
+		    g_cancellable_is_cancelled (cancellable)) {
+			if (item)
+				map_prefetch_item_free (item);
+			map_store_prefetch_clear (map_store);
+			priv->prefetch_running = FALSE;
+			g_mutex_unlock (priv->prefetch_lock);
+			break;
+		}
+
+		if (camel_map_folder_is_message_cached (CAMEL_MAP_FOLDER (item->folder), item->uid)) {
+			fetch = FALSE;
+		} else if (item->size > priv->prefetch_budget_bytes) {
+			/* Too big for what is left, smaller ones may still fit */
+			fetch = FALSE;
+		} else {
+			priv->prefetch_budget_messages--;
+			priv->prefetch_budget_bytes -= item->size;
+		}
+
+		g_mutex_unlock (priv->prefetch_lock);
+
+		if (fetch && !camel_map_folder_fetch_message (CAMEL_MAP_FOLDER (item->folder), item->uid, cancellable, &local_error)) {
+			d (g_debug ("Prefetch of %s failed: %s", item->uid, local_error ? local_error->message : "Unknown error"));
+			if (g_error_matches (local_error, CAMEL_SERVICE_ERROR, CAMEL_SERVICE_ERROR_UNAVAILABLE)) {
+				/* Disconnected, drop the rest */
+				g_mutex_lock (priv->prefetch_lock);
+				map_store_prefetch_clear (map_store);
+				g_mutex_unlock (priv->prefetch_lock);
+			}
+			g_clear_error (&local_error);
+		}
+
+		map_prefetch_item_free (item);
+	}
+}
+
 static gboolean
 map_disconnect_sync (CamelService *service,
                      gboolean clean,
@@ -302,10 +526,31 @@ map_disconnect_sync (CamelService *service,
 {
 	CamelMapStore *map_store = (CamelMapStore *) service;
 	CamelServiceClass *service_class;
+	GPtrArray *folders;
+	guint i;
 
 	//camel_map_dbus_set_notification_registration (map_store->priv->map, FALSE,
 	//					      cancellable, error);			
 
+	/* Whatever was queued belongs to the old session */
+	g_mutex_lock (map_store->priv->prefetch_lock);
+	map_store_prefetch_clear (map_store);
+	g_mutex_unlock (map_store->priv->prefetch_lock);
+
+	/* Don't leave summary changes waiting for a timer */
+	folders = camel_object_bag_list (CAMEL_STORE (map_store)->folders);
+	for (i = 0; i < folders->len; i++) {
+		CamelFolder *folder = g_ptr_array_index (folders, i);
+
+		if (CAMEL_IS_MAP_FOLDER (folder))
+			camel_map_folder_save_summary (CAMEL_MAP_FOLDER (folder));
+		g_object_unref (folder);
+	}
+	g_ptr_array_free (folders, TRUE);
+
+	/* Cursor holders take connection_lock to get the proxy, so the
+	 * cursor has to come first here too */
+	CURRENT_FOLDER_LOCK();
 	g_mutex_lock (map_store->priv->connection_lock);
 	g_object_unref (map_store->priv->session);
 	map_store->priv->session = NULL;
@@ -315,9 +560,12 @@ map_disconnect_sync (CamelService *service,
 	map_store->priv->connection = NULL;
 	g_free (map_store->priv->session_path);
 	map_store->priv->session_path = NULL;
-
 	g_mutex_unlock (map_store->priv->connection_lock);
 
+	/* A new session starts at the root again */
+	CURRENT_FOLDER (NULL);
+	CURRENT_FOLDER_UNLOCK();
+
 	service_class = CAMEL_SERVICE_CLASS (camel_map_store_parent_class);
 	return service_class->disconnect_sync (service, clean, cancellable, error);
 }
@@ -353,67 +601,53 @@ map_get_folder_sync (CamelStore *store,
 	CamelMapStore *map_store;
 	CamelFolder *folder = NULL;
 	gchar *fid, *folder_dir, *map_dir;
-	GVariant *ret;
 
+	/* Opening a folder is purely local: the folder selects itself on
+	 * the device the first time an operation actually needs it, so
+	 * cached folders open instantly and also while offline. */
 	map_dir = g_strdup_printf ("/telecom/msg/%s", folder_name);
 	map_store = (CamelMapStore *)store;
-	CURRENT_FOLDER_LOCK();
-	ret = camel_map_dbus_set_current_folder (map_store->priv->map,
-						 map_dir,
-						 cancellable,
-						 error);
-	CURRENT_FOLDER_UNLOCK();
-	if (!ret) {
-		printf("Unable to set current folder to: %s\n", map_dir);
-		return NULL;
-	}
 	folder_dir = g_build_filename (map_store->storage_path, "folders", folder_name, NULL);
-	folder = camel_map_folder_new (store, map_store->priv->map, map_dir, folder_name, folder_dir, cancellable, error);
+	folder = camel_map_folder_new (store, map_dir, folder_name, folder_dir, cancellable, error);
 
 	g_free (folder_dir);
+	g_free (map_dir);
 
 	return folder;
 }
 
-static void
-create_folder_hierarchy (CamelStore *store,
+/* Walks the folder tree below parent on the device and appends the
+ * full names (relative to /telecom/msg) of every folder found, parents
+ * before their children. Expects the current folder lock to be held. */
+static gboolean
+create_folder_hierarchy (CamelMapStore *map_store,
 			 const char *parent,
-			 CamelFolderInfo **fiparent,
-			 GHashTable *table,
+			 GPtrArray *folders,
 			 GCancellable *cancellable,
 			 GError **error)
 {
-	GVariant *folders;
-	GVariant *child, *subchild, *tchild, *ret;
+	GVariant *listing;
+	GVariant *child, *subchild, *tchild;
 	GVariantIter iter, subiter, titer;
-	CamelMapStore *map_store;
-	CamelFolderInfo *fi = NULL, *parent_fi;
-	
-	map_store = (CamelMapStore *) store;
-	parent_fi = (CamelFolderInfo *)*fiparent;
+	gboolean success = TRUE;
 
-	ret = camel_map_dbus_set_current_folder (map_store->priv->map,
-						 parent,
-						 cancellable,
-						 error);
-	if (ret == NULL) {
-		printf("Set folder to %s failed\n", parent);
-		return;
-	}
-	CURRENT_FOLDER(parent);
-	folders = camel_map_dbus_get_folder_listing (map_store->priv->map, 
+	/* Siblings are reached with a ".." and a child move rather
+	 * than a full walk down from the root. */
+	if (!map_store_navigate (map_store, parent, FALSE, cancellable, error))
+		return FALSE;
+	listing = camel_map_dbus_get_folder_listing (map_store->priv->map, 
 			cancellable, error);
-	if (folders == NULL) {
+	if (listing == NULL) {
 		printf("Unable to get folder listing in: %s\n", parent);
-		return;
+		return FALSE;
 	}
 
-	g_variant_iter_init (&iter, folders);
-	while ((child = g_variant_iter_next_value (&iter))) {
+	g_variant_iter_init (&iter, listing);
+	while (success && (child = g_variant_iter_next_value (&iter))) {
 		g_variant_iter_init (&subiter, child);
-		while ((subchild = g_variant_iter_next_value (&subiter))) {
+		while (success && (subchild = g_variant_iter_next_value (&subiter))) {
 			g_variant_iter_init (&titer, subchild);		
-			while ((tchild = g_variant_iter_next_value (&titer))) {
+			while (success && (tchild = g_variant_iter_next_value (&titer))) {
 				gchar *name, *folder, *newfolder;
 				GVariant *value;
 				
@@ -423,38 +657,14 @@ create_folder_hierarchy (CamelStore *store,
 					   &value);
 				folder = (gchar *)g_variant_get_string (value, NULL);
 
-				if (!folder || !*folder || strcmp (folder, "msg") == 0 || strcmp (folder, "MSG") == 0)
-					continue;
-				newfolder = g_strdup_printf("%s/%s", parent, folder);
-				g_hash_table_insert (table, newfolder, newfolder);
-				if (fi == NULL) {
-					/* First FI in this hierarchy */
-					fi = camel_folder_info_new ();
-					if (parent_fi == NULL) {
-						/* We are exploring the root dir */
-						*fiparent = fi;
-					} else {
-						/* Link upto the parent FI */
-						fi->parent = parent_fi;
-					}
-				} else {
-					CamelFolderInfo *info = camel_folder_info_new ();
-		
-					info->parent = parent_fi;
-					fi->next = info;
-					fi = info;
-				}
+				if (folder && *folder && strcmp (folder, "msg") != 0 && strcmp (folder, "MSG") != 0) {
+					newfolder = g_strdup_printf("%s/%s", parent, folder);
+					g_ptr_array_add (folders, g_strdup (newfolder+strlen("/telecom/msg/")));
 
-				fi->full_name = g_strdup (newfolder+strlen("/telecom/msg/"));
-				if (!g_ascii_strcasecmp(fi->full_name, "inbox")) {
-					fi->display_name = g_strdup (_("Inbox"));
-					fi->flags = (fi->flags & ~CAMEL_FOLDER_TYPE_MASK) | CAMEL_FOLDER_TYPE_INBOX;
-					fi->flags |= CAMEL_FOLDER_SYSTEM;
-				} else
-					fi->display_name = g_strdup (folder);
-				/* Add the tree to store summary if not there already */
-				/* Parse the subtree now */
-				create_folder_hierarchy (store, newfolder, &fi, table, cancellable, error);
+					/* Parse the subtree now */
+					success = create_folder_hierarchy (map_store, newfolder, folders, cancellable, error);
+					g_free (newfolder);
+				}
 			
 				g_free (name);
 				g_variant_unref (value);
@@ -464,6 +674,161 @@ create_folder_hierarchy (CamelStore *store,
 		}
 		g_variant_unref (child);
 	}
+	g_variant_unref (listing);
+
+	return success;
+}
+
+static CamelFolderInfo *
+map_store_build_folder_info (CamelMapStore *map_store,
+			     const gchar *fid)
+{
+	CamelMapStoreSummary *map_summary = map_store->summary;
+	CamelFolderInfo *fi;
+
+	fi = camel_folder_info_new ();
+	fi->full_name = camel_map_store_summary_get_folder_full_name (map_summary, fid, NULL);
+	fi->flags = camel_map_store_summary_get_folder_flags (map_summary, fid, NULL);
+	if ((fi->flags & CAMEL_FOLDER_TYPE_MASK) == CAMEL_FOLDER_TYPE_INBOX)
+		fi->display_name = g_strdup (_("Inbox"));
+	else
+		fi->display_name = camel_map_store_summary_get_folder_name (map_summary, fid, NULL);
+	fi->total = camel_map_store_summary_get_folder_total (map_summary, fid, NULL);
+	fi->unread = camel_map_store_summary_get_folder_unread (map_summary, fid, NULL);
+
+	return fi;
+}
+
+/* Brings the store summary in line with a complete device walk, and
+ * optionally tells the store listeners about the differences. */
+static void
+map_store_sync_folder_tree (CamelMapStore *map_store,
+			    GPtrArray *folders,
+			    gboolean notify)
+{
+	CamelMapStoreSummary *map_summary = map_store->summary;
+	GHashTable *seen;
+	GSList *cached, *l;
+	guint i;
+
+	seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+	for (i = 0; i < folders->len; i++) {
+		const gchar *full_name = g_ptr_array_index (folders, i);
+		const gchar *display_name;
+		gchar *parent_fid = NULL;
+		guint64 flags = 0;
+
+		g_hash_table_insert (seen, (gpointer) full_name, (gpointer) full_name);
+		if (camel_map_store_summary_has_folder (map_summary, full_name))
+			continue;
+
+		display_name = strrchr (full_name, '/');
+		if (display_name) {
+			parent_fid = g_strndup (full_name, display_name - full_name);
+			display_name++;
+		} else
+			display_name = full_name;
+
+		if (!g_ascii_strcasecmp (full_name, "inbox"))
+			flags = CAMEL_FOLDER_TYPE_INBOX | CAMEL_FOLDER_SYSTEM;
+
+		camel_map_store_summary_new_folder (map_summary, full_name, parent_fid,
+						    NULL, display_name, flags, 0);
+		g_free (parent_fid);
+
+		if (notify) {
+			CamelFolderInfo *fi;
+
+			fi = map_store_build_folder_info (map_store, full_name);
+			camel_store_folder_created (CAMEL_STORE (map_store), fi);
+			camel_folder_info_free (fi);
+		}
+	}
+
+	cached = camel_map_store_summary_get_folders (map_summary, NULL);
+	for (l = cached; l != NULL; l = g_slist_next (l)) {
+		const gchar *fid = l->data;
+		CamelFolderInfo *fi = NULL;
+
+		if (g_hash_table_lookup (seen, fid))
+			continue;
+
+		if (notify)
+			fi = map_store_build_folder_info (map_store, fid);
+		camel_map_store_summary_remove_folder (map_summary, fid, NULL);
+		if (fi) {
+			camel_store_folder_deleted (CAMEL_STORE (map_store), fi);
+			camel_folder_info_free (fi);
+		}
+	}
+
+	g_slist_free_full (cached, g_free);
+	g_hash_table_destroy (seen);
+}
+
+static gboolean
+map_store_refresh_folder_tree (CamelMapStore *map_store,
+			       gboolean notify,
+			       GCancellable *cancellable,
+			       GError **error)
+{
+	GPtrArray *folders;
+	gboolean success;
+
+	folders = g_ptr_array_new_with_free_func (g_free);
+
+	CURRENT_FOLDER_LOCK();
+	success = create_folder_hierarchy (map_store, "/telecom/msg", folders, cancellable, error);
+	CURRENT_FOLDER_UNLOCK();
+
+	/* A partial walk would make every folder we did not reach
+	 * look deleted, so only reconcile a complete one. */
+	if (success) {
+		map_store_sync_folder_tree (map_store, folders, notify);
+		camel_map_store_summary_save (map_store->summary, NULL);
+	}
+
+	g_ptr_array_free (folders, TRUE);
+
+	return success;
+}
+
+static void
+map_store_refresh_finfo (CamelSession *session,
+			 GCancellable *cancellable,
+			 CamelMapStore *map_store,
+			 GError **error)
+{
+	if (!camel_offline_store_get_online (CAMEL_OFFLINE_STORE (map_store)) ||
+	    !map_store->priv->map)
+		return;
+
+	map_store_refresh_folder_tree (map_store, TRUE, cancellable, error);
+}
+
+static CamelFolderInfo *
+folder_info_from_store_summary (CamelMapStore *map_store,
+				const gchar *top)
+{
+	CamelFolderInfo *root_fi;
+	GPtrArray *folder_infos;
+	GSList *folders, *l;
+
+	folders = camel_map_store_summary_get_folders (map_store->summary, top);
+	if (!folders)
+		return NULL;
+
+	folder_infos = g_ptr_array_new ();
+	for (l = folders; l != NULL; l = g_slist_next (l))
+		g_ptr_array_add (folder_infos, map_store_build_folder_info (map_store, l->data));
+
+	root_fi = camel_folder_info_build (folder_infos, top, '/', TRUE);
+
+	g_ptr_array_free (folder_infos, TRUE);
+	g_slist_free_full (folders, g_free);
+
+	return root_fi;
 }
 
 static CamelFolderInfo *
@@ -476,25 +841,43 @@ map_get_folder_info_sync (CamelStore *store,
 	CamelMapStore *map_store;
 	CamelMapStorePrivate *priv;
 	CamelFolderInfo *fi = NULL;
-	GHashTable *allfolders;
+	time_t now;
+
 	map_store = (CamelMapStore *) store;
 	priv = map_store->priv;
 
+	if (top && !*top)
+		top = NULL;
+
 	g_mutex_lock (priv->get_finfo_lock);
 
+	/* Serve the cached tree, it is good enough even when offline */
+	fi = folder_info_from_store_summary (map_store, top);
+
 	if (!(camel_offline_store_get_online (CAMEL_OFFLINE_STORE (store))
-	      && camel_service_connect_sync ((CamelService *) store, cancellable, error))) {
+	      && camel_service_connect_sync ((CamelService *) store, cancellable, fi ? NULL : error))) {
 		g_mutex_unlock (priv->get_finfo_lock);
 
-		return NULL;
+		return fi;
 	}
 
+	now = time (NULL);
+	if (!fi) {
+		/* Nothing cached yet, walk the phone right away */
+		priv->last_refresh_time = now;
+		if (map_store_refresh_folder_tree (map_store, FALSE, cancellable, error))
+			fi = folder_info_from_store_summary (map_store, top);
+	} else if (now - priv->last_refresh_time > FINFO_REFRESH_INTERVAL) {
+		/* Revalidate in the background, differences are announced
+		 * through the folder-created/deleted signals. */
+		priv->last_refresh_time = now;
+		camel_session_submit_job (
+			camel_service_get_session (CAMEL_SERVICE (store)),
+			(CamelSessionCallback) map_store_refresh_finfo,
+			g_object_ref (store),
+			(GDestroyNotify) g_object_unref);
+	}
 
-	/* Get the folder hierarchy from the phone */
-	allfolders = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-	CURRENT_FOLDER_LOCK()
-	create_folder_hierarchy (store, "/telecom/msg", &fi, allfolders, cancellable, error);
-	CURRENT_FOLDER_UNLOCK();
 	g_mutex_unlock (priv->get_finfo_lock);
 
 	return fi;
@@ -689,9 +1072,16 @@ map_store_finalize (GObject *object)
 	map_store = CAMEL_MAP_STORE (object);
 
 	g_free (map_store->storage_path);
+	map_store_prefetch_clear (map_store);
+	g_queue_free (map_store->priv->prefetch_queue);
+	g_mutex_free (map_store->priv->prefetch_lock);
+	g_cond_free (map_store->priv->prefetch_cond);
 	g_mutex_free (map_store->priv->get_finfo_lock);
 	g_mutex_free (map_store->priv->connection_lock);
-	g_rec_mutex_clear (&map_store->priv->current_folder_lock);
+	map_store_operations_clear (map_store);
+	g_queue_free (map_store->priv->op_queue);
+	g_mutex_free (map_store->priv->sched_lock);
+	g_cond_free (map_store->priv->sched_cond);
 
 	/* Chain up to parent's finalize() method. */
 	G_OBJECT_CLASS (camel_map_store_parent_class)->finalize (object);
@@ -748,8 +1138,13 @@ camel_map_store_init (CamelMapStore *map_store)
 	map_store->priv->last_refresh_time = time (NULL) - (FINFO_REFRESH_INTERVAL + 10);
 	map_store->priv->get_finfo_lock = g_mutex_new ();
 	map_store->priv->connection_lock = g_mutex_new ();
-	g_rec_mutex_init(&map_store->priv->current_folder_lock);
+	map_store->priv->sched_lock = g_mutex_new ();
+	map_store->priv->sched_cond = g_cond_new ();
+	map_store->priv->op_queue = g_queue_new ();
 	map_store->priv->current_selected_folder = NULL;
+	map_store->priv->prefetch_lock = g_mutex_new ();
+	map_store->priv->prefetch_cond = g_cond_new ();
+	map_store->priv->prefetch_queue = g_queue_new ();
 
 }
 
@@ -759,44 +1154,322 @@ camel_map_store_set_current_folder (CamelMapStore *map_store,
 				    GCancellable *cancellable,
 				    GError **error)
 {
-	GVariant *ret;
+	CamelSettings *settings;
+	gboolean force, success;
+
+	/* Some phones only accept message operations right after a
+	 * SetFolder, even when the session is already in that folder. */
+	settings = camel_service_ref_settings (CAMEL_SERVICE (map_store));
+	force = camel_map_settings_get_force_set_folder (CAMEL_MAP_SETTINGS (settings));
+	g_object_unref (settings);
+
 	/* Its a recurring lock, so no harm locking it again. */
 	CURRENT_FOLDER_LOCK();
+	success = map_store_navigate (map_store, folder, force, cancellable, error);
+	CURRENT_FOLDER_UNLOCK();
 
-	/* It appears that we have to forcefully set the current folder for certain ops to work,
-	   even though we are in the same folder. */
-        /*
-	if (0 && g_strcmp0(map_store->priv->current_selected_folder, folder) == 0) {
-		CURRENT_FOLDER_UNLOCK();
-		return TRUE;
-		}
-	*/
+	return success;
+}
 
-	ret = camel_map_dbus_set_current_folder (map_store->priv->map,
-						 folder,
-						 cancellable,
-						 error);
-	if (ret == NULL) {
-		printf("Set folder to %s failed\n", folder);
-		CURRENT_FOLDER_UNLOCK();
-		return FALSE;
+/* Whether a should get the cursor before b: higher priority first,
+ * then whoever stays in the folder we are already in, then in order of
+ * arrival. Expects the sched lock to be held. */
+static gboolean
+map_store_sched_before (CamelMapStore *map_store,
+			const MapSchedWaiter *a,
+			const MapSchedWaiter *b)
+{
+	const gchar *current = map_store->priv->current_selected_folder;
+	gboolean a_here, b_here;
+
+	if (a->priority != b->priority)
+		return a->priority < b->priority;
+
+	a_here = current && a->map_dir && g_str_equal (a->map_dir, current);
+	b_here = current && b->map_dir && g_str_equal (b->map_dir, current);
+	if (a_here != b_here)
+		return a_here;
+
+	return a->serial < b->serial;
+}
+
+/* Expects the sched lock to be held */
+static MapSchedWaiter *
+map_store_sched_next (CamelMapStore *map_store)
+{
+	MapSchedWaiter *best = NULL;
+	GList *link;
+
+	for (link = map_store->priv->sched_waiters; link; link = link->next) {
+		if (!best || map_store_sched_before (map_store, link->data, best))
+			best = link->data;
 	}
-	CURRENT_FOLDER(folder);
-	CURRENT_FOLDER_UNLOCK();
 
-	return TRUE;
+	return best;
 }
 
+/**
+ * camel_map_store_folder_lock:
+ * @map_store: a #CamelMapStore
+ * @priority: what the cursor is needed for
+ * @map_dir: the folder the operation will move to, or %NULL
+ *
+ * Waits until the remote cursor is free and no more urgent request is
+ * waiting for it. Requests of the same priority for the folder the
+ * session is already in go first, so that work for one folder is done
+ * together rather than moving back and forth. The lock is recursive.
+ **/
 void
-camel_map_store_folder_lock (CamelMapStore *map_store)
+camel_map_store_folder_lock (CamelMapStore *map_store,
+			     CamelMapOperationPriority priority,
+			     const gchar *map_dir)
 {
-	CURRENT_FOLDER_LOCK();
+	CamelMapStorePrivate *priv = map_store->priv;
+	MapSchedWaiter waiter;
+
+	g_mutex_lock (priv->sched_lock);
+
+	if (priv->sched_owner == g_thread_self ()) {
+		priv->sched_depth++;
+		g_mutex_unlock (priv->sched_lock);
+		return;
+	}
+
+	waiter.priority = priority;
+	waiter.map_dir = map_dir;
+	waiter.serial = priv->sched_serial++;
+	priv->sched_waiters = g_list_append (priv->sched_waiters, &waiter);
+
+	while (priv->sched_owner || map_store_sched_next (map_store) != &waiter)
+		g_cond_wait (priv->sched_cond, priv->sched_lock);
+
+	priv->sched_waiters = g_list_remove (priv->sched_waiters, &waiter);
+	priv->sched_owner = g_thread_self ();
+	priv->sched_depth = 1;
+
+	g_mutex_unlock (priv->sched_lock);
 }
 
 void 
 camel_map_store_folder_unlock (CamelMapStore *map_store)
 {
-	CURRENT_FOLDER_UNLOCK();
+	CamelMapStorePrivate *priv = map_store->priv;
+
+	g_mutex_lock (priv->sched_lock);
+	if (--priv->sched_depth == 0) {
+		priv->sched_owner = NULL;
+		g_cond_broadcast (priv->sched_cond);
+	}
+	g_mutex_unlock (priv->sched_lock);
+}
+
+static void
+map_operation_free (MapOperation *op)
+{
+	if (op->destroy)
+		op->destroy (op->user_data);
+	g_free (op->map_dir);
+	g_free (op);
+}
+
+static void
+map_store_operations_clear (CamelMapStore *map_store)
+{
+	MapOperation *op;
+
+	while ((op = g_queue_pop_head (map_store->priv->op_queue)))
+		map_operation_free (op);
+}
+
+static void
+map_store_operation_job (CamelSession *session,
+			 GCancellable *cancellable,
+			 CamelMapStore *map_store,
+			 GError **error)
+{
+	CamelMapStorePrivate *priv = map_store->priv;
+
+	while (TRUE) {
+		MapOperation *op = NULL;
+		GError *local_error = NULL;
+		GList *link;
+
+		/* Same order the cursor is handed out in */
+		g_mutex_lock (priv->sched_lock);
+		for (link = g_queue_peek_head_link (priv->op_queue); link; link = link->next) {
+			MapOperation *candidate = link->data;
+
+			if (!op || map_store_sched_before (map_store, &candidate->waiter, &op->waiter))
+				op = candidate;
+		}
+		if (!op) {
+			priv->op_running = FALSE;
+			g_mutex_unlock (priv->sched_lock);
+			break;
+		}
+		g_queue_remove (priv->op_queue, op);
+		g_mutex_unlock (priv->sched_lock);
+
+		camel_map_store_folder_lock (map_store, op->waiter.priority, op->map_dir);
+		if (!op->func (map_store, op->user_data, cancellable, &local_error))
+			g_warning ("Queued operation failed: %s", local_error ? local_error->message : "Unknown error");
+		camel_map_store_folder_unlock (map_store);
+
+		g_clear_error (&local_error);
+		map_operation_free (op);
+	}
+}
+
+/**
+ * camel_map_store_queue_operation:
+ * @map_store: a #CamelMapStore
+ * @priority: how urgent the operation is
+ * @map_dir: the folder the operation works on, or %NULL
+ * @func: called with the cursor locked
+ * @user_data: data for @func
+ * @destroy: frees @user_data once @func has run, or %NULL
+ *
+ * Runs @func in the background once the scheduler hands it the cursor,
+ * for operations nobody is waiting on. @func is still expected to move
+ * to @map_dir with camel_map_store_set_current_folder().
+ **/
+void
+camel_map_store_queue_operation (CamelMapStore *map_store,
+				 CamelMapOperationPriority priority,
+				 const gchar *map_dir,
+				 CamelMapOperationFunc func,
+				 gpointer user_data,
+				 GDestroyNotify destroy)
+{
+	CamelMapStorePrivate *priv = map_store->priv;
+	MapOperation *op;
+
+	op = g_new0 (MapOperation, 1);
+	op->map_dir = g_strdup (map_dir);
+	op->waiter.priority = priority;
+	op->waiter.map_dir = op->map_dir;
+	op->func = func;
+	op->user_data = user_data;
+	op->destroy = destroy;
+
+	g_mutex_lock (priv->sched_lock);
+	op->waiter.serial = priv->sched_serial++;
+	g_queue_push_tail (priv->op_queue, op);
+
+	if (!priv->op_running) {
+		CamelSession *session;
+
+		priv->op_running = TRUE;
+		session = camel_service_get_session (CAMEL_SERVICE (map_store));
+		camel_session_submit_job (
+			session,
+			(CamelSessionCallback) map_store_operation_job,
+			g_object_ref (map_store),
+			(GDestroyNotify) g_object_unref);
+	}
+	g_mutex_unlock (priv->sched_lock);
+}
+
+/* Queues the bodies of uids (typically the messages a refresh just
+ * added) for download in the background, newest first, when the
+ * account or the folder is set to stay synchronized. Every call starts
+ * a fresh budget from the prefetch-max-messages and prefetch-max-size
+ * settings. */
+void
+camel_map_store_queue_prefetch (CamelMapStore *map_store,
+				CamelFolder *folder,
+				GPtrArray *uids)
+{
+	CamelMapStorePrivate *priv = map_store->priv;
+	CamelSettings *settings;
+	CamelMapSettings *map_settings;
+	gboolean stay_sync;
+	guint max_messages, max_size;
+	gint i;
+
+	settings = camel_service_ref_settings (CAMEL_SERVICE (map_store));
+	map_settings = CAMEL_MAP_SETTINGS (settings);
+	stay_sync = camel_offline_settings_get_stay_synchronized (CAMEL_OFFLINE_SETTINGS (settings));
+	max_messages = camel_map_settings_get_prefetch_max_messages (map_settings);
+	max_size = camel_map_settings_get_prefetch_max_size (map_settings);
+	g_object_unref (settings);
+
+	if (!stay_sync && !camel_offline_folder_get_offline_sync (CAMEL_OFFLINE_FOLDER (folder)))
+		return;
+
+	if (!uids->len || !max_messages || !max_size)
+		return;
+
+	g_mutex_lock (priv->prefetch_lock);
+
+	for (i = 0; i < uids->len; i++) {
+		CamelMessageInfoBase *info;
+		MapPrefetchItem *item;
+
+		info = (CamelMessageInfoBase *) camel_folder_summary_get (folder->summary, uids->pdata[i]);
+		if (!info)
+			continue;
+
+		item = g_new0 (MapPrefetchItem, 1);
+		item->folder = g_object_ref (folder);
+		item->uid = g_strdup (uids->pdata[i]);
+		item->size = info->size;
+		item->date = info->date_received;
+		camel_message_info_free (info);
+
+		g_queue_insert_sorted (priv->prefetch_queue, item, map_prefetch_item_cmp, NULL);
+	}
+
+	priv->prefetch_budget_messages = max_messages;
+	priv->prefetch_budget_bytes = (guint64) max_size * 1024;
+
+	if (!priv->prefetch_running && !g_queue_is_empty (priv->prefetch_queue)) {
+		CamelSession *session;
+
+		priv->prefetch_running = TRUE;
+		session = camel_service_get_session (CAMEL_SERVICE (map_store));
+		camel_session_submit_job (
+			session,
+			(CamelSessionCallback) map_store_prefetch_job,
+			g_object_ref (map_store),
+			(GDestroyNotify) g_object_unref);
+	}
+
+	g_mutex_unlock (priv->prefetch_lock);
+}
+
+/* Foreground message fetches bracket themselves with these so that
+ * the prefetcher backs off until the user's request is done. */
+void
+camel_map_store_begin_foreground_fetch (CamelMapStore *map_store)
+{
+	g_mutex_lock (map_store->priv->prefetch_lock);
+	map_store->priv->foreground_fetches++;
+	g_mutex_unlock (map_store->priv->prefetch_lock);
+}
+
+void
+camel_map_store_end_foreground_fetch (CamelMapStore *map_store)
+{
+	g_mutex_lock (map_store->priv->prefetch_lock);
+	if (--map_store->priv->foreground_fetches == 0)
+		g_cond_broadcast (map_store->priv->prefetch_cond);
+	g_mutex_unlock (map_store->priv->prefetch_lock);
+}
+
+/* Returns a new reference to the MessageAccess proxy of the current
+ * session, or NULL while disconnected. */
+GDBusProxy *
+camel_map_store_ref_map_proxy (CamelMapStore *map_store)
+{
+	GDBusProxy *map = NULL;
+
+	g_mutex_lock (map_store->priv->connection_lock);
+	if (map_store->priv->map)
+		map = g_object_ref (map_store->priv->map);
+	g_mutex_unlock (map_store->priv->connection_lock);
+
+	return map;
 }
 
 const char *
@@ -817,6 +1490,18 @@ camel_map_store_set_initial_fetch (CamelMapStore *map_store, gboolean fetch)
 	map_store->priv->initial_fetch = fetch;
 }
 
+gboolean
+camel_map_store_get_fractions_supported (CamelMapStore *map_store)
+{
+	return g_atomic_int_get (&map_store->priv->fractions_supported);
+}
+
+void
+camel_map_store_set_fractions_supported (CamelMapStore *map_store, gboolean supported)
+{
+	g_atomic_int_set (&map_store->priv->fractions_supported, supported ? 1 : 0);
+}
+
 gboolean
 camel_map_store_update_inbox (CamelMapStore *map_store,
 			      GCancellable *cancellable,
@@ -70,18 +70,48 @@ struct _CamelMapStoreClass {
 	CamelOfflineStoreClass parent_class;
 };
 
+/* Who gets the remote cursor first, most urgent first */
+typedef enum {
+	CAMEL_MAP_OPERATION_FOREGROUND,	/* a message the user opened */
+	CAMEL_MAP_OPERATION_FLAGS,	/* flag changes and deletions */
+	CAMEL_MAP_OPERATION_REFRESH,	/* listings and navigation */
+	CAMEL_MAP_OPERATION_PREFETCH	/* background downloads */
+} CamelMapOperationPriority;
+
+typedef gboolean (*CamelMapOperationFunc)		(CamelMapStore *map_store,
+							 gpointer user_data,
+							 GCancellable *cancellable,
+							 GError **error);
+
 GType camel_map_store_get_type (void);
 
 gboolean	camel_map_store_set_current_folder 	(CamelMapStore *map_store,
 				    		    	 const char *folder,
 							 GCancellable *cancellable,
 							 GError **error);
-void		camel_map_store_folder_lock 		(CamelMapStore *map_store);
+void		camel_map_store_folder_lock 		(CamelMapStore *map_store,
+							 CamelMapOperationPriority priority,
+							 const gchar *map_dir);
 void 		camel_map_store_folder_unlock 		(CamelMapStore *map_store);
+void		camel_map_store_queue_operation		(CamelMapStore *map_store,
+							 CamelMapOperationPriority priority,
+							 const gchar *map_dir,
+							 CamelMapOperationFunc func,
+							 gpointer user_data,
+							 GDestroyNotify destroy);
+GDBusProxy *	camel_map_store_ref_map_proxy 		(CamelMapStore *map_store);
+void		camel_map_store_queue_prefetch 		(CamelMapStore *map_store,
+							 CamelFolder *folder,
+							 GPtrArray *uids);
+void		camel_map_store_begin_foreground_fetch 	(CamelMapStore *map_store);
+void		camel_map_store_end_foreground_fetch 	(CamelMapStore *map_store);
 const char *	camel_map_store_get_map_session_path 	(CamelMapStore *map_store);
 gboolean	camel_map_store_get_initial_fetch 	(CamelMapStore *map_store);
 void		camel_map_store_set_initial_fetch 	(CamelMapStore *map_store, 
 							 gboolean fetch);
+gboolean	camel_map_store_get_fractions_supported	(CamelMapStore *map_store);
+void		camel_map_store_set_fractions_supported	(CamelMapStore *map_store,
+							 gboolean supported);
 gboolean	camel_map_store_update_inbox 		(CamelMapStore *map_store,
 							 GCancellable *cancellable,
 							 GError **error);
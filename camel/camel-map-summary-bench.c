@@ -0,0 +1,127 @@
+/* Measures what the summary infos of a large folder cost, built through
+ * a CamelMapSummary with a content info of its own per message as
+ * before, and with the shared placeholder. Each mode runs in its own
+ * process, freed memory would skew the next.
+ *
+ *   camel-map-summary-bench [count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <camel/camel.h>
+
+#include "camel-map-folder.h"
+#include "camel-map-summary.h"
+
+#define DEFAULT_COUNT 100000
+
+/* The summary reports flag changes to its folder; there is none here
+ * and no flags are changed */
+void
+camel_map_folder_mark_message_read (CamelMapFolder *map_folder,
+				    const char *uid,
+				    gboolean read)
+{
+}
+
+void
+camel_map_folder_discard_flag_change (CamelMapFolder *map_folder,
+				      const char *uid,
+				      guint32 flag)
+{
+}
+
+static glong
+resident_kb (void)
+{
+	glong size = 0, resident = 0;
+	FILE *f;
+
+	f = fopen ("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	if (fscanf (f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose (f);
+
+	return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static void
+run (guint count,
+     gboolean shared)
+{
+	CamelFolderSummary *summary;
+	CamelMessageInfo **infos;
+	CamelMessageContentInfo *placeholder;
+	gchar uid[32];
+	glong rss;
+	gint64 start;
+	guint i;
+
+	summary = g_object_new (CAMEL_TYPE_MAP_SUMMARY, NULL);
+	camel_folder_summary_set_build_content (summary, TRUE);
+	placeholder = camel_map_summary_get_placeholder_content ();
+
+	infos = g_new0 (CamelMessageInfo *, count);
+	rss = resident_kb ();
+	start = g_get_monotonic_time ();
+
+	for (i = 0; i < count; i++) {
+		CamelMessageInfoBase *mi;
+
+		mi = (CamelMessageInfoBase *) camel_message_info_new (summary);
+		g_snprintf (uid, sizeof (uid), "%016x", 0x20000000 + i);
+		mi->uid = camel_pstring_strdup (uid);
+		if (shared) {
+			mi->content = placeholder;
+		} else {
+			/* What an unparsed message got before */
+			mi->content = camel_folder_summary_content_info_new (summary);
+			mi->content->type = camel_content_type_new ("multipart", "mixed");
+		}
+		infos[i] = (CamelMessageInfo *) mi;
+	}
+
+	printf("%-12s %u infos: %ld KiB, %.1f ms",
+	       shared ? "shared" : "per-message", count,
+	       resident_kb () - rss,
+	       (g_get_monotonic_time () - start) / 1000.0);
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < count; i++)
+		camel_message_info_free (infos[i]);
+	g_free (infos);
+	printf(", freed in %.1f ms\n", (g_get_monotonic_time () - start) / 1000.0);
+
+	g_object_unref (summary);
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+	guint count = DEFAULT_COUNT;
+	gint shared;
+
+	g_type_init ();
+
+	if (argc > 1)
+		count = strtoul (argv[1], NULL, 10);
+
+	for (shared = 0; shared < 2; shared++) {
+		pid_t pid = fork ();
+
+		if (pid == 0) {
+			run (count, shared);
+			fflush (stdout);
+			_exit (0);
+		} else if (pid > 0) {
+			waitpid (pid, NULL, 0);
+		}
+	}
+
+	return 0;
+}
@@ -37,7 +37,17 @@
 #include "camel-map-folder.h"
 #include "camel-map-summary.h"
 
-#define CAMEL_MAP_SUMMARY_VERSION (1)
+#define CAMEL_MAP_SUMMARY_VERSION (2)
+
+/* Since version 2 the MAP fields of a message are kept in bdata as a
+ * fixed width record of lowercase hex digits, decoded without any
+ * number parsing:
+ *
+ *   'm' handle(16) type(2) status(2) server_flags(8) fingerprint(8)
+ *
+ * Version 1 held just server_flags as a decimal number. */
+#define MAP_RECORD_MARKER 'm'
+#define MAP_RECORD_LENGTH (1 + 16 + 2 + 2 + 8 + 8)
 
 #define EXTRACT_FIRST_DIGIT(val) part ? val=strtoul (part, &part, 10) : 0;
 #define EXTRACT_DIGIT(val) part++; part ? val=strtoul (part, &part, 10) : 0;
@@ -67,19 +77,27 @@ map_message_info_clone (CamelFolderSummary *s,
 
 	to = (CamelMapMessageInfo *) CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->message_info_clone (s, mi);
 	to->server_flags = from->server_flags;
+	to->handle = from->handle;
+	to->type = from->type;
+	to->status = from->status;
+	to->fingerprint = from->fingerprint;
 
 	/* FIXME: parent clone should do this */
-	to->info.content = camel_folder_summary_content_info_new (s);
+	to->info.content = camel_map_summary_get_placeholder_content ();
 
 	return (CamelMessageInfo *) to;
 }
 
+/* camel_message_info_free() frees the content before the message info
+ * hook runs, so the shared placeholder has to be skipped here */
 static void
-map_message_info_free (CamelFolderSummary *s,
-                       CamelMessageInfo *mi)
+map_content_info_free (CamelFolderSummary *s,
+                       CamelMessageContentInfo *ci)
 {
+	if (ci == camel_map_summary_get_placeholder_content ())
+		return;
 
-	CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->message_info_free (s, mi);
+	CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->content_info_free (s, ci);
 }
 
 static void
@@ -103,7 +121,7 @@ camel_map_summary_class_init (CamelMapSummaryClass *class)
 	folder_summary_class->message_info_size = sizeof (CamelMapMessageInfo);
 	folder_summary_class->content_info_size = sizeof (CamelMapMessageContentInfo);
 	folder_summary_class->message_info_clone = map_message_info_clone;
-	folder_summary_class->message_info_free = map_message_info_free;
+	folder_summary_class->content_info_free = map_content_info_free;
 	folder_summary_class->info_set_flags = map_info_set_flags;
 	folder_summary_class->summary_header_to_db = summary_header_to_db;
 	folder_summary_class->summary_header_from_db = summary_header_from_db;
@@ -134,6 +152,8 @@ camel_map_summary_new (struct _CamelFolder *folder)
 	summary = g_object_new (CAMEL_TYPE_MAP_SUMMARY, "folder", folder, NULL);
 	camel_folder_summary_set_build_content (summary, TRUE);
 
+	/* Rows of older versions still decode, they are written in the
+	 * current format whenever they are saved next */
 	camel_folder_summary_load_from_db (summary, NULL);
 
 	return summary;
@@ -153,6 +173,8 @@ summary_header_from_db (CamelFolderSummary *s,
 
 	if (part)
 		EXTRACT_FIRST_DIGIT (gms->version);
+	if (part && *part == ' ')
+		gms->listing_time = g_ascii_strtoll (part + 1, &part, 10);
 
 	return TRUE;
 }
@@ -167,12 +189,63 @@ summary_header_to_db (CamelFolderSummary *s,
 	if (!fir)
 		return NULL;
 
-	fir->bdata = g_strdup_printf ("%d", CAMEL_MAP_SUMMARY_VERSION);
+	fir->bdata = g_strdup_printf (
+		"%d %" G_GINT64_FORMAT, CAMEL_MAP_SUMMARY_VERSION,
+		CAMEL_MAP_SUMMARY (s)->listing_time);
 
 	return fir;
 
 }
 
+/* FALSE if the next digits aren't all hex, the record isn't ours then */
+static gboolean
+map_record_get_hex (const gchar **part,
+		    gint digits,
+		    guint64 *value)
+{
+	const gchar *p = *part;
+	gint i, digit;
+
+	*value = 0;
+	for (i = 0; i < digits; i++) {
+		digit = g_ascii_xdigit_value (p[i]);
+		if (digit < 0)
+			return FALSE;
+		*value = (*value << 4) | digit;
+	}
+	*part = p + digits;
+
+	return TRUE;
+}
+
+/* Reads a version 2 record into iinfo, leaving it alone if the
+ * record is short or damaged */
+static gboolean
+map_record_decode (const gchar *part,
+		   CamelMapMessageInfo *iinfo)
+{
+	guint64 handle, type, status, server_flags, fingerprint;
+
+	if (!part || *part != MAP_RECORD_MARKER || strlen (part) < MAP_RECORD_LENGTH)
+		return FALSE;
+
+	part++;
+	if (!map_record_get_hex (&part, 16, &handle) ||
+	    !map_record_get_hex (&part, 2, &type) ||
+	    !map_record_get_hex (&part, 2, &status) ||
+	    !map_record_get_hex (&part, 8, &server_flags) ||
+	    !map_record_get_hex (&part, 8, &fingerprint))
+		return FALSE;
+
+	iinfo->handle = handle;
+	iinfo->type = type;
+	iinfo->status = status;
+	iinfo->server_flags = server_flags;
+	iinfo->fingerprint = fingerprint;
+
+	return TRUE;
+}
+
 static CamelMessageInfo *
 message_info_from_db (CamelFolderSummary *s,
                       CamelMIRecord *mir)
@@ -182,11 +255,14 @@ message_info_from_db (CamelFolderSummary *s,
 
 	info = CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->message_info_from_db (s, mir);
 	if (info) {
-		gchar *part = mir->bdata;
+		const gchar *part = mir->bdata;
 
 		iinfo = (CamelMapMessageInfo *) info;
-		if (part && *part) {
-			iinfo->server_flags = g_ascii_strtoll (part, NULL, 10);
+		if (!map_record_decode (part, iinfo)) {
+			/* Version 1 */
+			if (part && *part)
+				iinfo->server_flags = g_ascii_strtoll (part, NULL, 10);
+			iinfo->handle = camel_map_uid_to_handle (camel_message_info_uid (info));
 		}
 	}
 
@@ -202,7 +278,10 @@ message_info_to_db (CamelFolderSummary *s,
 
 	mir = CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->message_info_to_db (s, info);
 	if (mir)
-		mir->bdata = g_strdup_printf ("%u", iinfo->server_flags);
+		mir->bdata = g_strdup_printf (
+			"%c%016" G_GINT64_MODIFIER "x%02x%02x%08x%08x", MAP_RECORD_MARKER,
+			iinfo->handle, iinfo->type, iinfo->status,
+			iinfo->server_flags, iinfo->fingerprint);
 
 	return mir;
 }
@@ -225,7 +304,7 @@ content_info_from_db (CamelFolderSummary *s,
 	if (type)
 		return CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->content_info_from_db (s, mir);
 	else
-		return camel_folder_summary_content_info_new (s);
+		return camel_map_summary_get_placeholder_content ();
 }
 
 static gboolean
@@ -234,7 +313,7 @@ content_info_to_db (CamelFolderSummary *s,
                     CamelMIRecord *mir)
 {
 
-	if (info->type) {
+	if (info->type && info != camel_map_summary_get_placeholder_content ()) {
 		mir->cinfo = g_strdup ("1");
 		return CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->content_info_to_db (s, info, mir);
 	} else {
@@ -251,8 +330,17 @@ map_info_set_flags (CamelMessageInfo *info,
 	if ((flags & CAMEL_MESSAGE_SEEN) != 0) {
 		/* Message is marked read/unread */
 		if ((((CamelMessageInfoBase *)info)->flags & CAMEL_MESSAGE_SEEN) != (set & CAMEL_MESSAGE_SEEN)) {
-			printf("Marking message read: %s\n", info->uid);
-			camel_map_folder_mark_message_read ((CamelMapFolder *)camel_folder_summary_get_folder(info->summary), info->uid, (set & CAMEL_MESSAGE_SEEN) != 0);
+			CamelMapFolder *map_folder = (CamelMapFolder *)camel_folder_summary_get_folder(info->summary);
+
+			/* Only a change away from what the device has needs
+			 * writing; server changes arrive here already recorded
+			 * in server_flags and don't bounce back */
+			if ((set & CAMEL_MESSAGE_SEEN) != (((CamelMapMessageInfo *) info)->server_flags & CAMEL_MESSAGE_SEEN)) {
+				printf("Marking message read: %s\n", info->uid);
+				camel_map_folder_mark_message_read (map_folder, info->uid, (set & CAMEL_MESSAGE_SEEN) != 0);
+			} else {
+				camel_map_folder_discard_flag_change (map_folder, info->uid, CAMEL_MESSAGE_SEEN);
+			}
 		}
 	}
 	return CAMEL_FOLDER_SUMMARY_CLASS (camel_map_summary_parent_class)->info_set_flags (info, flags, set);
@@ -329,8 +417,10 @@ camel_map_update_message_info_flags (CamelFolderSummary *summary,
 		server_set = server_flags & ~einfo->server_flags;
 		server_cleared = einfo->server_flags & ~server_flags;
 
-		camel_message_info_set_flags (info, server_set | server_cleared, (einfo->info.flags | server_set) & ~server_cleared);
+		/* Recorded first, so that map_info_set_flags() can tell
+		 * this isn't a local change */
 		einfo->server_flags = server_flags;
+		camel_message_info_set_flags (info, server_set | server_cleared, (einfo->info.flags | server_set) & ~server_cleared);
 		if (info->summary)
 			camel_folder_summary_touch (info->summary);
 		changed = TRUE;
@@ -372,3 +462,30 @@ map_summary_clear (CamelFolderSummary *summary,
 	camel_folder_summary_free_array (known_uids);
 }
 
+/* Until a message body has been parsed nothing is known about its
+ * structure, so all such messages share this one immutable content
+ * info instead of each carrying an empty one. */
+CamelMessageContentInfo *
+camel_map_summary_get_placeholder_content (void)
+{
+	static gsize placeholder = 0;
+
+	if (g_once_init_enter (&placeholder)) {
+		CamelMessageContentInfo *ci;
+
+		ci = (CamelMessageContentInfo *) g_new0 (CamelMapMessageContentInfo, 1);
+		ci->type = camel_content_type_new ("multipart", "mixed");
+
+		g_once_init_leave (&placeholder, (gsize) ci);
+	}
+
+	return (CamelMessageContentInfo *) placeholder;
+}
+
+/* MAP handles are 64 bit numbers the device writes in hex; the uid is
+ * that hex string */
+guint64
+camel_map_uid_to_handle (const gchar *uid)
+{
+	return uid ? g_ascii_strtoull (uid, NULL, 16) : 0;
+}
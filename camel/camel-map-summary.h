@@ -51,10 +51,32 @@ typedef struct _CamelMapMessageInfo CamelMapMessageInfo;
 typedef struct _CamelMapMessageContentInfo CamelMapMessageContentInfo;
 
 
+/* The MAP Type property of a message */
+typedef enum {
+	CAMEL_MAP_MESSAGE_TYPE_UNKNOWN,
+	CAMEL_MAP_MESSAGE_TYPE_EMAIL,
+	CAMEL_MAP_MESSAGE_TYPE_SMS_GSM,
+	CAMEL_MAP_MESSAGE_TYPE_SMS_CDMA,
+	CAMEL_MAP_MESSAGE_TYPE_MMS
+} CamelMapMessageType;
+
+/* The MAP Status property, whether the device holds all of it */
+typedef enum {
+	CAMEL_MAP_MESSAGE_STATUS_UNKNOWN,
+	CAMEL_MAP_MESSAGE_STATUS_COMPLETE,
+	CAMEL_MAP_MESSAGE_STATUS_FRACTIONED,
+	CAMEL_MAP_MESSAGE_STATUS_NOTIFICATION
+} CamelMapMessageStatus;
+
 struct _CamelMapMessageInfo {
 	CamelMessageInfoBase info;
 
 	guint32 server_flags;
+
+	guint64 handle;		/* the uid as a number */
+	guint8 type;		/* CamelMapMessageType */
+	guint8 status;		/* CamelMapMessageStatus */
+	guint32 fingerprint;	/* of the listing properties that change */
 } ;
 
 struct _CamelMapMessageContentInfo {
@@ -65,6 +87,7 @@ struct _CamelMapSummary {
 	CamelFolderSummary parent;
 
 	gint32 version;
+	gint64 listing_time;	/* when the device state was last listed, 0 if never */
 } ;
 
 struct _CamelMapSummaryClass {
@@ -81,6 +104,10 @@ gboolean
 					 CamelMessageInfo *info,
 					 guint32 server_flags,
 					 CamelFlag *server_user_flags);
+guint64	camel_map_uid_to_handle		(const gchar *uid);
+CamelMessageContentInfo *
+	camel_map_summary_get_placeholder_content
+					(void);
 void	camel_map_summary_add_message	(CamelFolderSummary *summary,
 					 const gchar *uid,
 					 CamelMimeMessage *message);
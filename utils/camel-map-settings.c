@@ -29,6 +29,9 @@ struct _CamelMapSettingsPrivate {
 	gboolean check_all;
 	gboolean filter_junk;
 	gboolean filter_junk_inbox;
+	gboolean force_set_folder;
+	guint prefetch_max_messages;
+	guint prefetch_max_size;
 	char *email;
 	char *device_name;
 	char *device_str_address;
@@ -46,6 +49,9 @@ enum {
 	PROP_CHECK_ALL,
 	PROP_FILTER_JUNK,
 	PROP_FILTER_JUNK_INBOX,
+	PROP_FORCE_SET_FOLDER,
+	PROP_PREFETCH_MAX_MESSAGES,
+	PROP_PREFETCH_MAX_SIZE,
 	PROP_AUTH_MECHANISM,
 	PROP_HOST,
 	PROP_SECURITY_METHOD,
@@ -122,6 +128,24 @@ map_settings_set_property (GObject *object,
 				CAMEL_MAP_SETTINGS (object),
 				g_value_get_boolean (value));
 			return;
+
+		case PROP_FORCE_SET_FOLDER:
+			camel_map_settings_set_force_set_folder (
+				CAMEL_MAP_SETTINGS (object),
+				g_value_get_boolean (value));
+			return;
+
+		case PROP_PREFETCH_MAX_MESSAGES:
+			camel_map_settings_set_prefetch_max_messages (
+				CAMEL_MAP_SETTINGS (object),
+				g_value_get_uint (value));
+			return;
+
+		case PROP_PREFETCH_MAX_SIZE:
+			camel_map_settings_set_prefetch_max_size (
+				CAMEL_MAP_SETTINGS (object),
+				g_value_get_uint (value));
+			return;
 		case PROP_PORT:
 			camel_network_settings_set_port (
 				CAMEL_NETWORK_SETTINGS (object),
@@ -216,6 +240,27 @@ map_settings_get_property (GObject *object,
 				camel_map_settings_get_filter_junk_inbox (
 				CAMEL_MAP_SETTINGS (object)));
 			return;
+
+		case PROP_FORCE_SET_FOLDER:
+			g_value_set_boolean (
+				value,
+				camel_map_settings_get_force_set_folder (
+				CAMEL_MAP_SETTINGS (object)));
+			return;
+
+		case PROP_PREFETCH_MAX_MESSAGES:
+			g_value_set_uint (
+				value,
+				camel_map_settings_get_prefetch_max_messages (
+				CAMEL_MAP_SETTINGS (object)));
+			return;
+
+		case PROP_PREFETCH_MAX_SIZE:
+			g_value_set_uint (
+				value,
+				camel_map_settings_get_prefetch_max_size (
+				CAMEL_MAP_SETTINGS (object)));
+			return;
 		case PROP_USER:
 			g_value_take_string (
 				value,
@@ -374,6 +419,42 @@ camel_map_settings_class_init (CamelMapSettingsClass *class)
 			G_PARAM_READWRITE |
 			G_PARAM_CONSTRUCT |
 			G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (
+		object_class,
+		PROP_FORCE_SET_FOLDER,
+		g_param_spec_boolean (
+			"force-set-folder",
+			"Force Set Folder",
+			"Whether to re-send SetFolder even when already in the folder",
+			FALSE,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (
+		object_class,
+		PROP_PREFETCH_MAX_MESSAGES,
+		g_param_spec_uint (
+			"prefetch-max-messages",
+			"Prefetch Max Messages",
+			"Maximum number of messages downloaded in the background after a refresh",
+			0, G_MAXUINT, 50,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property (
+		object_class,
+		PROP_PREFETCH_MAX_SIZE,
+		g_param_spec_uint (
+			"prefetch-max-size",
+			"Prefetch Max Size",
+			"Maximum number of kilobytes downloaded in the background after a refresh",
+			0, G_MAXUINT, 5120,
+			G_PARAM_READWRITE |
+			G_PARAM_CONSTRUCT |
+			G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -630,6 +711,123 @@ camel_map_settings_set_filter_junk_inbox (CamelMapSettings *settings,
 	g_object_notify (G_OBJECT (settings), "filter-junk-inbox");
 }
 
+/**
+ * camel_map_settings_get_force_set_folder:
+ * @settings: a #CamelMapSettings
+ *
+ * Returns whether the device needs SetFolder to be sent before every
+ * message operation, even when the session is already in that folder.
+ *
+ * Returns: whether to always re-send SetFolder
+ **/
+gboolean
+camel_map_settings_get_force_set_folder (CamelMapSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_MAP_SETTINGS (settings), FALSE);
+
+	return settings->priv->force_set_folder;
+}
+
+/**
+ * camel_map_settings_set_force_set_folder:
+ * @settings: a #CamelMapSettings
+ * @force_set_folder: whether to always re-send SetFolder
+ *
+ * Sets whether the device needs SetFolder to be sent before every
+ * message operation. Only some phones require this.
+ **/
+void
+camel_map_settings_set_force_set_folder (CamelMapSettings *settings,
+                                         gboolean force_set_folder)
+{
+	g_return_if_fail (CAMEL_IS_MAP_SETTINGS (settings));
+
+	if ((settings->priv->force_set_folder ? 1 : 0) == (force_set_folder ? 1 : 0))
+		return;
+
+	settings->priv->force_set_folder = force_set_folder;
+
+	g_object_notify (G_OBJECT (settings), "force-set-folder");
+}
+
+/**
+ * camel_map_settings_get_prefetch_max_messages:
+ * @settings: a #CamelMapSettings
+ *
+ * Returns how many message bodies may be downloaded in the background
+ * after each refresh when the account stays synchronized.
+ *
+ * Returns: the per-refresh prefetch message budget
+ **/
+guint
+camel_map_settings_get_prefetch_max_messages (CamelMapSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_MAP_SETTINGS (settings), 0);
+
+	return settings->priv->prefetch_max_messages;
+}
+
+/**
+ * camel_map_settings_set_prefetch_max_messages:
+ * @settings: a #CamelMapSettings
+ * @prefetch_max_messages: the per-refresh prefetch message budget
+ *
+ * Sets how many message bodies may be downloaded in the background
+ * after each refresh.
+ **/
+void
+camel_map_settings_set_prefetch_max_messages (CamelMapSettings *settings,
+                                              guint prefetch_max_messages)
+{
+	g_return_if_fail (CAMEL_IS_MAP_SETTINGS (settings));
+
+	if (settings->priv->prefetch_max_messages == prefetch_max_messages)
+		return;
+
+	settings->priv->prefetch_max_messages = prefetch_max_messages;
+
+	g_object_notify (G_OBJECT (settings), "prefetch-max-messages");
+}
+
+/**
+ * camel_map_settings_get_prefetch_max_size:
+ * @settings: a #CamelMapSettings
+ *
+ * Returns how many kilobytes of message bodies may be downloaded in
+ * the background after each refresh when the account stays synchronized.
+ *
+ * Returns: the per-refresh prefetch size budget, in kilobytes
+ **/
+guint
+camel_map_settings_get_prefetch_max_size (CamelMapSettings *settings)
+{
+	g_return_val_if_fail (CAMEL_IS_MAP_SETTINGS (settings), 0);
+
+	return settings->priv->prefetch_max_size;
+}
+
+/**
+ * camel_map_settings_set_prefetch_max_size:
+ * @settings: a #CamelMapSettings
+ * @prefetch_max_size: the per-refresh prefetch size budget, in kilobytes
+ *
+ * Sets how many kilobytes of message bodies may be downloaded in the
+ * background after each refresh.
+ **/
+void
+camel_map_settings_set_prefetch_max_size (CamelMapSettings *settings,
+                                          guint prefetch_max_size)
+{
+	g_return_if_fail (CAMEL_IS_MAP_SETTINGS (settings));
+
+	if (settings->priv->prefetch_max_size == prefetch_max_size)
+		return;
+
+	settings->priv->prefetch_max_size = prefetch_max_size;
+
+	g_object_notify (G_OBJECT (settings), "prefetch-max-size");
+}
+
 
 guint
 camel_map_settings_get_channel (CamelMapSettings *settings)
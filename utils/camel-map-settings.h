@@ -84,6 +84,21 @@ gboolean	camel_map_settings_get_filter_junk_inbox
 void		camel_map_settings_set_filter_junk_inbox 
 						(CamelMapSettings *settings,
                                           	 gboolean filter_junk_inbox);
+gboolean	camel_map_settings_get_force_set_folder
+						(CamelMapSettings *settings);
+void		camel_map_settings_set_force_set_folder
+						(CamelMapSettings *settings,
+						 gboolean force_set_folder);
+guint		camel_map_settings_get_prefetch_max_messages
+						(CamelMapSettings *settings);
+void		camel_map_settings_set_prefetch_max_messages
+						(CamelMapSettings *settings,
+						 guint prefetch_max_messages);
+guint		camel_map_settings_get_prefetch_max_size
+						(CamelMapSettings *settings);
+void		camel_map_settings_set_prefetch_max_size
+						(CamelMapSettings *settings,
+						 guint prefetch_max_size);
 
 
 const gchar *	camel_map_settings_get_service_name